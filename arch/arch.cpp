@@ -1,9 +1,14 @@
+#include <algorithm>
+#include <random>
+#include <string>
+
 #include "computer.h"
 #include "terminal.h"
 #include "disk.h"
 #include "timer.h"
 #include "memory.h"
 #include "cpu.h"
+#include "snapshot.h"
 
 // ---------------------------------------
 
@@ -11,37 +16,244 @@ namespace Arch {
 
 // ---------------------------------------
 
-Computer::Computer ()
+Computer::Computer (const Terminal::Settings& terminal_settings, const Disk::Settings& disk_settings)
+	: terminal(*this, terminal_settings),
+	  disk(*this, disk_settings),
+	  timer(*this),
+	  memory(*this),
+	  cpu(*this)
 {
-	for (auto& port: this->io_ports)
-		port = nullptr;
-	
-	this->terminal = new Terminal(*this);
-	this->disk = new Disk(*this);
-	this->timer = new Timer(*this);
-	this->memory = new Memory(*this);
-	this->cpu = new Cpu(*this);
-
-	this->devices.push_back(this->terminal);
-	this->devices.push_back(this->disk);
-	this->devices.push_back(this->timer);
-	this->devices.push_back(this->memory);
-	this->devices.push_back(this->cpu);
 }
 
 Computer::~Computer ()
 {
-	for (auto *device: this->devices)
-		delete device;
 }
 
+// Instead of calling every device in every cycle, devices schedule the
+// cycle of their next event, and the cpu runs uninterrupted in between.
+// A halted cpu only wakes up on an interrupt, which can only be raised by a
+// device event, so the cycles in between are skipped at once.
+// The terminal is woken up by its input thread instead, see post_terminal_event.
+
 void Computer::run ()
 {
 	while (this->alive) {
-		for (auto *device: this->devices)
-			device->run_cycle();
-		this->cycle++;
+		if (this->terminal_event_posted.exchange(false))
+			this->schedule(DeviceId::Terminal, this->cycle);
+
+		while (!this->events.empty() && this->events.top().cycle <= this->cycle) {
+			const Event event = this->events.top();
+			this->events.pop();
+
+			uint64_t& event_cycle = this->event_cycles[ std::to_underlying(event.device_id) ];
+
+			// the device rescheduled after this event was queued
+			if (event_cycle != event.cycle)
+				continue;
+
+			event_cycle = Device::no_event;
+			this->run_event(event.device_id);
+		}
+
+		if (this->cycle >= this->snapshot_cycle) {
+			this->snapshot_cycle = Device::no_event;
+			this->save_snapshot(this->snapshot_fname);
+		}
+
+		if (this->cycle >= this->checkpoint_cycle) {
+			this->checkpoint_cycle = this->cycle + this->checkpoint_interval;
+			this->save_checkpoint();
+		}
+
+		const uint64_t burst_end = std::min({
+			this->events.empty() ? std::numeric_limits<uint64_t>::max() : this->events.top().cycle,
+			this->snapshot_cycle,
+			this->checkpoint_cycle
+			});
+
+		this->burst_end.store(burst_end);
+
+		// posted after the check above, its store to burst_end may have been lost
+		if (this->terminal_event_posted.load())
+			continue;
+
+		if (this->cpu.is_halted()) {
+			// only a key can wake it up
+			if (burst_end == std::numeric_limits<uint64_t>::max()) {
+				this->terminal_event_posted.wait(false);
+				continue;
+			}
+
+			this->idle_cycles += burst_end - this->cycle;
+			this->cycle = burst_end;
+		}
+		else
+			this->cpu.run_burst();
+	}
+}
+
+static std::string checkpoint_fname (const std::string_view prefix, const uint32_t n)
+{
+	return std::string(prefix) + "." + std::to_string(n);
+}
+
+void Computer::save_snapshot (const std::string_view fname) const
+{
+	Snapshot::Writer out;
+
+	this->memory.save(out);
+	this->save_devices(out);
+
+	out.save(fname);
+}
+
+void Computer::load_snapshot (const std::string_view fname)
+{
+	Snapshot::Reader in(fname);
+
+	mylib_assert_exception_msg(in.get_header().sequence == 0, fname, " is an incremental checkpoint, it can only be loaded with the ones before it")
+
+	this->memory.load(in);
+	this->load_devices(in);
+}
+
+void Computer::save_checkpoint ()
+{
+	const uint32_t id = std::random_device()();
+	Snapshot::Writer out(this->checkpoint_sequence, id, this->checkpoint_parent);
+
+	if (this->checkpoint_sequence == 0)
+		this->memory.save(out);
+	else
+		this->memory.save_delta(out);
+
+	this->save_devices(out);
+
+	out.save(checkpoint_fname(this->checkpoint_prefix, this->checkpoint_sequence));
+
+	this->memory.clear_dirty();
+	this->checkpoint_sequence++;
+	this->checkpoint_parent = id;
+}
+
+// Only the memory changes from one checkpoint to the next, the other
+// devices are loaded from checkpoint n alone.
+// After a rollback, files from the abandoned run may remain past the new
+// ones, their parent doesn't match and the replay stops there.
+
+void Computer::load_checkpoint (const std::string_view prefix, const uint32_t n)
+{
+	uint32_t parent = 0;
+
+	for (uint32_t i = 0; i <= n; i++) {
+		const std::string fname = checkpoint_fname(prefix, i);
+		Snapshot::Reader in(fname);
+
+		mylib_assert_exception_msg(in.get_header().sequence == i && in.get_header().parent == parent, fname, " is not checkpoint ", i, " of the chain ", prefix)
+
+		parent = in.get_header().id;
+
+		this->memory.load(in);
+
+		if (i == n)
+			this->load_devices(in);
+	}
+
+	this->memory.clear_dirty();
+
+	this->checkpoint_prefix = prefix;
+	this->checkpoint_sequence = n + 1;
+	this->checkpoint_parent = parent;
+}
+
+void Computer::save_checkpoints_every (const std::string_view prefix, const uint64_t interval)
+{
+	mylib_assert_exception(interval > 0)
+
+	if (prefix != this->checkpoint_prefix) {
+		this->checkpoint_prefix = prefix;
+		this->checkpoint_sequence = 0;
+		this->checkpoint_parent = 0;
+	}
+
+	this->checkpoint_interval = interval;
+	this->checkpoint_cycle = this->cycle + interval;
+	this->end_burst();
+}
+
+void Computer::save_devices (Snapshot::Writer& out) const
+{
+	this->terminal.save(out);
+	this->disk.save(out);
+	this->timer.save(out);
+	this->cpu.save(out);
+
+	out.begin(DeviceId::Count);
+	out.put(this->cycle);
+	out.put(this->idle_cycles);
+	out.put_span(std::span<const uint64_t>(this->event_cycles));
+}
+
+void Computer::load_devices (Snapshot::Reader& in)
+{
+	this->terminal.load(in);
+	this->disk.load(in);
+	this->timer.load(in);
+	this->cpu.load(in);
+
+	in.begin(DeviceId::Count);
+	in.get(this->cycle);
+	in.get(this->idle_cycles);
+	in.get_span(std::span(this->event_cycles));
+	in.end();
+
+	// only the current event of each device is queued again
+	this->events = decltype(this->events)();
+
+	for (uint32_t i = 0; i < this->event_cycles.size(); i++) {
+		if (this->event_cycles[i] != Device::no_event) {
+			this->events.push(Event {
+				.cycle = this->event_cycles[i],
+				.device_id = static_cast<DeviceId>(i)
+				});
+		}
 	}
+
+	this->end_burst();
+}
+
+void Computer::run_event (const DeviceId device_id)
+{
+	switch (device_id) {
+		case DeviceId::Terminal:
+			this->terminal.run_cycle();
+		break;
+
+		case DeviceId::Disk:
+			this->disk.run_cycle();
+		break;
+
+		case DeviceId::Timer:
+			this->timer.run_cycle();
+		break;
+
+		default:
+			mylib_throw_exception_msg("device ", std::to_underlying(device_id), " has no events");
+	}
+}
+
+void Computer::schedule (const DeviceId device_id, const uint64_t cycle)
+{
+	mylib_assert_exception(cycle >= this->cycle)
+
+	this->event_cycles[ std::to_underlying(device_id) ] = cycle;
+	this->events.push(Event {
+		.cycle = cycle,
+		.device_id = device_id
+		});
+
+	if (cycle < this->get_burst_end())
+		this->burst_end.store(cycle, std::memory_order_relaxed);
 }
 
 // ---------------------------------------
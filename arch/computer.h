@@ -2,7 +2,14 @@
 #define __ARQSIM_HEADER_ARCH_COMPUTER_H__
 
 #include <array>
-#include <list>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <queue>
+#include <functional>
+#include <limits>
+#include <string>
+#include <string_view>
 
 #include <cstdint>
 
@@ -11,44 +18,90 @@
 
 #include "../config.h"
 #include "device.h"
+#include "terminal.h"
+#include "disk.h"
+#include "timer.h"
+#include "memory.h"
+#include "cpu.h"
 
 namespace Arch {
 
 // ---------------------------------------
 
-class Terminal;
-class Disk;
-class Timer;
-class Memory;
-class Cpu;
+// The machine is fixed, so the devices are concrete members instead of
+// heap objects behind base class pointers.
+// Their events are dispatched with a switch, without virtual calls.
 
 class Computer
 {
 private:
-	std::list<Device*> devices;
-	std::array<IO_Device*, 1 << 16> io_ports;
-	Terminal *terminal;
-	Disk *disk;
-	Timer *timer;
-	Memory *memory;
-	Cpu *cpu;
+	struct Event {
+		uint64_t cycle;
+		DeviceId device_id; // devices due in the same cycle run in DeviceId order
+
+		auto operator<=> (const Event& other) const = default;
+	};
+
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+
+	// cycle of the event currently scheduled by each device
+	std::array<uint64_t, std::to_underlying(DeviceId::Count)> event_cycles = [] () {
+		std::array<uint64_t, std::to_underlying(DeviceId::Count)> cycles;
+		cycles.fill(Device::no_event);
+		return cycles;
+	}();
+
+	// ports not routed by io_port_owner
+	std::unordered_map<uint16_t, IO_Device*> dynamic_io_ports;
 
 	bool alive = true;
 	uint64_t cycle = 0;
+	uint64_t idle_cycles = 0; // cycles skipped while the cpu was halted
+
+	// The cpu runs uninterrupted until this cycle, the earliest device event.
+	// Atomic only so post_terminal_event can end a burst from a host thread,
+	// the simulation itself uses relaxed loads and stores.
+	std::atomic<uint64_t> burst_end = 0;
+
+	// set by post_terminal_event, the terminal runs in the next burst boundary
+	std::atomic<bool> terminal_event_posted = false;
 
 	std::string turn_off_msg;
 
+	// see save_snapshot_at
+	std::string snapshot_fname;
+	uint64_t snapshot_cycle = Device::no_event;
+
+	// see save_checkpoint
+	std::string checkpoint_prefix;
+	uint64_t checkpoint_interval;
+	uint64_t checkpoint_cycle = Device::no_event;
+	uint32_t checkpoint_sequence = 0; // of the next checkpoint
+	uint32_t checkpoint_parent = 0; // id of the last checkpoint saved or loaded
+
+	// constructed in this order, after everything above
+	Terminal terminal;
+	Disk disk;
+	Timer timer;
+	Memory memory;
+	Cpu cpu;
+
 	inline static Computer *computer = nullptr;
 
 private:
-	Computer ();
+	Computer (const Terminal::Settings& terminal_settings, const Disk::Settings& disk_settings);
 	~Computer ();
 
 public:
-	static void init ()
+	static void init (const Terminal::Settings& terminal_settings = Terminal::Settings(), const Disk::Settings& disk_settings = Disk::Settings())
 	{
 		mylib_assert_exception(computer == nullptr)
-		computer = new Computer;
+		computer = new Computer(terminal_settings, disk_settings);
+	}
+
+	static bool is_initialized ()
+	{
+		return computer != nullptr;
 	}
 
 	static Computer& get ()
@@ -66,62 +119,200 @@ public:
 
 	void run ();
 
-	inline Terminal& get_terminal () const
+	// Saves the state of every device, see snapshot.h.
+	// The OS runs in the host, its own variables are not part of the
+	// machine, so the snapshot should be taken where OS::boot can rebuild
+	// them, e.g. when it is waiting for the first command.
+	// Raises Mylib::Exception if the file cannot be written.
+	void save_snapshot (const std::string_view fname) const;
+
+	// Restores a snapshot, replacing the state of every device.
+	// Raises Mylib::Exception if the file is not a snapshot of this machine,
+	// which is then left in an unknown state.
+	// The first checkpoint of a chain is a snapshot, the others are not.
+	void load_snapshot (const std::string_view fname);
+
+	// Checkpoints are snapshots saved as <prefix>.<n>.
+	// The first one, n = 0, has the whole memory, and each one after it only
+	// the pages written since the previous one.
+	void save_checkpoint ();
+
+	// Restores checkpoint n, replaying the memory of checkpoints 0 to n.
+	// Each one must have been saved right after the one before it.
+	// The following checkpoints continue the chain from n, replacing the
+	// ones after n.
+	void load_checkpoint (const std::string_view prefix, const uint32_t n);
+
+	// Saves a checkpoint every interval cycles, from now on.
+	// A different prefix starts a new chain.
+	void save_checkpoints_every (const std::string_view prefix, const uint64_t interval);
+
+	// Saves a snapshot in the first cycle >= cycle, between two bursts.
+	void save_snapshot_at (const std::string_view fname, const uint64_t cycle)
 	{
-		return *this->terminal;
+		this->snapshot_fname = fname;
+		this->snapshot_cycle = cycle;
+		this->end_burst();
 	}
 
-	inline Disk& get_disk () const
+	// Requests a call to the device's run_cycle() in the given cycle.
+	// Replaces the event previously scheduled by the device, if any.
+	void schedule (const DeviceId device_id, const uint64_t cycle);
+
+	inline uint64_t get_cycle () const
 	{
-		return *this->disk;
+		return this->cycle;
 	}
 
-	inline Timer& get_timer () const
+	inline uint64_t get_idle_cycles () const
 	{
-		return *this->timer;
+		return this->idle_cycles;
 	}
 
-	inline Memory& get_memory () const
+	inline uint64_t get_burst_end () const
 	{
-		return *this->memory;
+		return this->burst_end.load(std::memory_order_relaxed);
 	}
 
-	inline Cpu& get_cpu () const
+	inline void advance_cycles (const uint64_t n)
 	{
-		return *this->cpu;
+		this->cycle += n;
 	}
 
-	inline void set_io_port (const uint16_t port, IO_Device *device)
+	// ends the current cpu burst after the current cycle
+	inline void end_burst ()
 	{
-		mylib_assert_exception(port < this->io_ports.size())
-		this->io_ports[port] = device;
+		if (this->get_burst_end() > (this->cycle + 1))
+			this->burst_end.store(this->cycle + 1, std::memory_order_relaxed);
 	}
 
-	inline void set_io_port (const IO_Port port, IO_Device *device)
+	// Called from host threads, when the terminal has something to do:
+	// keys were typed, or the screen is due to be redrawn.
+	// Ends the current burst, and the terminal runs right after it.
+	void post_terminal_event ()
 	{
-		this->set_io_port(std::to_underlying(port), device);
+		this->terminal_event_posted.store(true);
+		this->burst_end.store(0);
+		this->terminal_event_posted.notify_one();
 	}
 
-	inline IO_Device& get_io_port (const uint16_t port) const
+	inline Terminal& get_terminal ()
+	{
+		return this->terminal;
+	}
+
+	inline const Terminal& get_terminal () const
+	{
+		return this->terminal;
+	}
+
+	inline Disk& get_disk ()
+	{
+		return this->disk;
+	}
+
+	inline const Disk& get_disk () const
+	{
+		return this->disk;
+	}
+
+	inline Timer& get_timer ()
+	{
+		return this->timer;
+	}
+
+	inline const Timer& get_timer () const
 	{
-		mylib_assert_exception(port < this->io_ports.size())
-		mylib_assert_exception(this->io_ports[port] != nullptr)
-		return *this->io_ports[port];
+		return this->timer;
 	}
 
-	inline IO_Device& get_io_port (const IO_Port port) const
+	inline Memory& get_memory ()
 	{
-		return this->get_io_port(std::to_underlying(port));
+		return this->memory;
+	}
+
+	inline const Memory& get_memory () const
+	{
+		return this->memory;
+	}
+
+	inline Cpu& get_cpu ()
+	{
+		return this->cpu;
+	}
+
+	inline const Cpu& get_cpu () const
+	{
+		return this->cpu;
+	}
+
+	// Built-in ports go straight to their device, without virtual calls.
+	// Other ports are looked up in the ports registered with set_io_port.
+
+	inline uint16_t read_io (const uint16_t port)
+	{
+		switch (io_port_owner(port)) {
+			case DeviceId::Terminal: return this->terminal.read(port);
+			case DeviceId::Timer:    return this->timer.read(port);
+			case DeviceId::Disk:     return this->disk.read(port);
+			default:                 return this->get_io_port(port).read(port);
+		}
+	}
+
+	inline void write_io (const uint16_t port, const uint16_t value)
+	{
+		switch (io_port_owner(port)) {
+			case DeviceId::Terminal: this->terminal.write(port, value); break;
+			case DeviceId::Timer:    this->timer.write(port, value); break;
+			case DeviceId::Disk:     this->disk.write(port, value); break;
+			default:                 this->get_io_port(port).write(port, value);
+		}
+	}
+
+	inline void set_io_port (const uint16_t port, IO_Device *device)
+	{
+		mylib_assert_exception_msg(io_port_owner(port) == DeviceId::Count, "port ", port, " belongs to a built-in device")
+		this->dynamic_io_ports[port] = device;
+	}
+
+	inline IO_Device& get_io_port (const uint16_t port) const
+	{
+		const auto it = this->dynamic_io_ports.find(port);
+
+		if (it == this->dynamic_io_ports.end())
+			mylib_throw_exception_msg("invalid io port ", port);
+
+		return *it->second;
 	}
 
 	inline void turn_off ()
 	{
 		this->alive = false;
+		this->end_burst();
 	}
+
+private:
+	void run_event (const DeviceId device_id);
+
+	// every section but the memory
+	void save_devices (Snapshot::Writer& out) const;
+	void load_devices (Snapshot::Reader& in);
 };
 
 // ---------------------------------------
 
+inline uint16_t Cpu::read_io (const uint16_t port)
+{
+	return this->computer.read_io(port);
+}
+
+inline void Cpu::write_io (const uint16_t port, const uint16_t value)
+{
+	this->computer.write_io(port, value);
+}
+
+// ---------------------------------------
+
 } // end namespace
 
 #endif
\ No newline at end of file
@@ -1,4 +1,7 @@
+#include <algorithm>
+
 #include "cpu.h"
+#include "computer.h"
 #include "terminal.h"
 #include "../os/os.h"
 
@@ -26,13 +29,43 @@ static const char* get_reg_name_str (const uint16_t code)
 	return strs[code];
 }
 
+// Register operand of a traced instruction.
+// The name is only looked up when the trace is actually printed.
+
+struct RegName {
+	uint16_t code;
+};
+
+static std::ostream& operator << (std::ostream& out, const RegName reg)
+{
+	out << get_reg_name_str(reg.code);
+	return out;
+}
+
+static std::unexpected<Cpu::CpuException> fault (const Cpu::CpuException::Type type, const uint16_t vaddr)
+{
+	return std::unexpected(Cpu::CpuException {
+		.type = type,
+		.vaddr = vaddr
+		});
+}
+
 // ---------------------------------------
 
 Cpu::Cpu (Computer& computer)
-	: Device(computer)
+	: Device(computer, DeviceId::Cpu),
+	  memory(computer.get_memory())
 {
 	for (auto& r: this->gprs)
 		r = 0;
+
+	this->blocks.resize(Config::phys_mem_size_words);
+
+	for (auto& f: this->code_frames)
+		f = false;
+
+	this->flush_tlb();
+	this->select_burst();
 }
 
 Cpu::~Cpu ()
@@ -40,43 +73,134 @@ Cpu::~Cpu ()
 	
 }
 
-void Cpu::run_cycle ()
+void Cpu::run_burst ()
 {
-	enum class InstrType : uint16_t {
-		R = 0,
-		I = 1
-	};
+	(this->*burst)();
+}
 
-	if (this->has_interrupt) { // check first if external interrupt
-		this->has_interrupt = false;
-		OS::interrupt(this->interrupt_code);
-		return;
-	}
+void Cpu::deliver_interrupt ()
+{
+	this->has_interrupt = false;
+	OS::interrupt(this->interrupt_code);
+	this->after_os_call();
+}
 
-	this->backup_pc = this->pc;
-	
-	try {
-		const Instruction instruction = this->vmem_read_instruction(this->pc);
+void Cpu::deliver_fault (const CpuException& e)
+{
+	this->pc = this->backup_pc;
+	this->cpu_exception = e;
+
+	OS::interrupt(InterruptCode::CpuException);
+	this->after_os_call();
+}
+
+// The OS may have changed the address space, and it edits page tables in
+// place, with no way to invalidate translations.
+// So nothing cached across an OS call can be trusted.
+
+void Cpu::after_os_call ()
+{
+	this->current_block = nullptr;
+	this->flush_tlb();
+
+	// the OS may also have rescheduled devices or changed the vmem mode
+	this->computer.end_burst();
+}
+
+void Cpu::select_burst ()
+{
+	static constexpr auto bursts = std::to_array<std::array<BurstFunction, 3>>({
+		{ &Cpu::interpret_burst<VmemMode::Disabled>, &Cpu::interpret_burst<VmemMode::BaseLimit>, &Cpu::interpret_burst<VmemMode::Paging> },
+		{ &Cpu::translated_burst<VmemMode::Disabled>, &Cpu::translated_burst<VmemMode::BaseLimit>, &Cpu::translated_burst<VmemMode::Paging> },
+		});
 
-		dprintln("\tPC = ", this->pc, " instr 0x", std::hex, instruction.to_underlying(), std::dec, " binary ", instruction.to_underlying());
+	mylib_assert_exception_msg(this->vmem_mode <= VmemMode::Paging, "invalid vmem mode ", static_cast<uint16_t>(this->vmem_mode))
 
-		this->pc++;
+	this->burst = bursts[ std::to_underlying(this->engine) ][this->vmem_mode];
+}
 
-		const InstrType type = static_cast<InstrType>( instruction[15] );
+// One instruction per cycle.
+// Interrupts are checked first, delivering one also takes a cycle.
+
+template <Cpu::VmemMode mode>
+void Cpu::interpret_burst ()
+{
+	while (this->computer.get_cycle() < this->computer.get_burst_end()) {
+		if (this->has_interrupt)
+			this->deliver_interrupt();
+		else {
+			const auto result = this->interpret<mode>();
 
-		if (type == InstrType::R)
-			this->execute_r(instruction);
-		else
-			this->execute_i(instruction);
+			if (!result) [[unlikely]]
+				this->deliver_fault(result.error());
+
+			if (trace_active<Config::TraceLevel::Full>())
+				this->dump();
+		}
+
+		this->computer.advance_cycles(1);
 	}
-	catch (const CpuException& e) {
-		this->pc = this->backup_pc;
-		this->cpu_exception = e;
+}
+
+// Same timing as interpret_burst, but whole blocks run at once.
+// execute_block advances the cycle count by itself.
+
+template <Cpu::VmemMode mode>
+void Cpu::translated_burst ()
+{
+	while (this->computer.get_cycle() < this->computer.get_burst_end()) {
+		if (this->has_interrupt) {
+			this->deliver_interrupt();
+			this->computer.advance_cycles(1);
+			continue;
+		}
+
+		if (this->current_block == nullptr || this->block_pos >= this->block_end || this->pc != this->block_vaddr) {
+			const auto entered = this->enter_block<mode>();
+
+			if (!entered) [[unlikely]] {
+				this->deliver_fault(entered.error());
+				this->computer.advance_cycles(1);
+				continue;
+			}
+		}
 
-		OS::interrupt(InterruptCode::CpuException);
+		// register dumps are printed after every instruction
+		const uint64_t budget = trace_active<Config::TraceLevel::Full>()
+			? 1
+			: (this->computer.get_burst_end() - this->computer.get_cycle());
+
+		const auto executed = this->execute_block<mode>( std::min<uint64_t>(budget, Config::page_size) );
+
+		if (!executed) [[unlikely]] {
+			this->deliver_fault(executed.error());
+			this->computer.advance_cycles(1);
+		}
+
+		if (trace_active<Config::TraceLevel::Full>())
+			this->dump();
 	}
+}
+
+template <Cpu::VmemMode mode>
+Cpu::Result<void> Cpu::interpret ()
+{
+	this->backup_pc = this->pc;
 
-	this->dump();
+	const auto fetched = this->vmem_read_instruction<mode>(this->pc);
+
+	if (!fetched) [[unlikely]]
+		return std::unexpected(fetched.error());
+
+	const uint16_t instruction = *fetched;
+	const DecodedInstruction& decoded = decode_table[instruction];
+
+	if (trace_active<Config::TraceLevel::Instruction>())
+		trace_instruction(this->pc, instruction, decoded);
+
+	this->pc++;
+
+	return this->execute<mode>(decoded);
 }
 
 void Cpu::turn_off ()
@@ -90,17 +214,33 @@ bool Cpu::interrupt (const InterruptCode interrupt_code)
 		return false;
 	this->interrupt_code = interrupt_code;
 	this->has_interrupt = true;
+	this->halted = false;
 	return true;
 }
 
+// The cpu sleeps until a device interrupts it.
+// The halt instruction itself takes one cycle, the following ones are
+// skipped by Computer::run.
+
+void Cpu::halt ()
+{
+	this->halted = true;
+	this->computer.end_burst();
+}
+
 void Cpu::force_interrupt (const InterruptCode interrupt_code)
 {
 	mylib_assert_exception(this->has_interrupt == false)
 	this->interrupt(interrupt_code);
 }
 
-void Cpu::execute_r (const Instruction instruction)
+constexpr Cpu::DecodedInstruction Cpu::decode (const uint16_t instruction)
 {
+	enum class InstrType : uint16_t {
+		R = 0,
+		I = 1
+	};
+
 	enum class OpcodeR : uint16_t {
 		Add = 0,
 		Sub = 1,
@@ -110,183 +250,601 @@ void Cpu::execute_r (const Instruction instruction)
 		Cmp_neq = 5,
 		Load = 15,
 		Store = 16,
+		Halt = 62,
 		Syscall = 63
 	};
 
-	const OpcodeR opcode = static_cast<OpcodeR>( instruction[{9, 6}] );
-	const uint16_t dest = instruction[{6, 3}];
-	const uint16_t op1 = instruction[{3, 3}];
-	const uint16_t op2 = instruction[{0, 3}];
+	enum class OpcodeI : uint16_t {
+		Jump = 0,
+		Jump_cond = 1,
+		Mov = 3
+	};
+
+	DecodedInstruction decoded = {
+		.handler = Handler::Invalid,
+		.dest = 0,
+		.op1 = 0,
+		.op2 = 0,
+		.imed = 0
+		};
+
+	const InstrType type = static_cast<InstrType>( (instruction >> 15) & 0x01 );
+
+	if (type == InstrType::R) {
+		const OpcodeR opcode = static_cast<OpcodeR>( (instruction >> 9) & 0x3F );
+
+		decoded.dest = (instruction >> 6) & 0x07;
+		decoded.op1 = (instruction >> 3) & 0x07;
+		decoded.op2 = instruction & 0x07;
+
+		switch (opcode) {
+			using enum OpcodeR;
+
+			case Add:        decoded.handler = Handler::Add; break;
+			case Sub:        decoded.handler = Handler::Sub; break;
+			case Mul:        decoded.handler = Handler::Mul; break;
+			case Div:        decoded.handler = Handler::Div; break;
+			case Cmp_equal:  decoded.handler = Handler::Cmp_equal; break;
+			case Cmp_neq:    decoded.handler = Handler::Cmp_neq; break;
+			case Load:       decoded.handler = Handler::Load; break;
+			case Store:      decoded.handler = Handler::Store; break;
+			case Syscall:    decoded.handler = Handler::Syscall; break;
+			case Halt:       decoded.handler = Handler::Halt; break;
+			default:         decoded.handler = Handler::Invalid;
+		}
+	}
+	else {
+		const OpcodeI opcode = static_cast<OpcodeI>( (instruction >> 13) & 0x03 );
+
+		decoded.dest = (instruction >> 10) & 0x07;
+		decoded.imed = instruction & 0x1FF;
 
-	switch (opcode) {
-		using enum OpcodeR;
+		switch (opcode) {
+			using enum OpcodeI;
+
+			case Jump:       decoded.handler = Handler::Jump; break;
+			case Jump_cond:  decoded.handler = Handler::Jump_cond; break;
+			case Mov:        decoded.handler = Handler::Mov; break;
+			default:         decoded.handler = Handler::Invalid;
+		}
+	}
+
+	return decoded;
+}
+
+constinit const std::array<Cpu::DecodedInstruction, 1 << 16> Cpu::decode_table = [] () {
+	std::array<DecodedInstruction, 1 << 16> table {};
+
+	for (uint32_t i = 0; i < table.size(); i++)
+		table[i] = decode(i);
+
+	return table;
+}();
+
+template <Cpu::VmemMode mode>
+Cpu::Result<void> Cpu::execute (const DecodedInstruction& instruction)
+{
+	const uint16_t dest = instruction.dest;
+	const uint16_t op1 = instruction.op1;
+	const uint16_t op2 = instruction.op2;
+	const uint16_t reg = instruction.dest;
+	const uint16_t imed = instruction.imed;
+
+	switch (instruction.handler) {
+		using enum Handler;
 
 		case Add:
-			dprintln("\tadd ", get_reg_name_str(dest), ", ", get_reg_name_str(op1), ", ", get_reg_name_str(op2));
 			this->gprs[dest] = this->gprs[op1] + this->gprs[op2];
 		break;
 
 		case Sub:
-			dprintln("\tsub ", get_reg_name_str(dest), ", ", get_reg_name_str(op1), ", ", get_reg_name_str(op2));
 			this->gprs[dest] = this->gprs[op1] - this->gprs[op2];
 		break;
 
 		case Mul:
-			dprintln("\tmul ", get_reg_name_str(dest), ", ", get_reg_name_str(op1), ", ", get_reg_name_str(op2));
 			this->gprs[dest] = this->gprs[op1] * this->gprs[op2];
 		break;
 
 		case Div:
-			dprintln("\tdiv ", get_reg_name_str(dest), ", ", get_reg_name_str(op1), ", ", get_reg_name_str(op2));
 			this->gprs[dest] = this->gprs[op1] / this->gprs[op2];
 		break;
 
 		case Cmp_equal:
-			dprintln("\tcmp_equal ", get_reg_name_str(dest), ", ", get_reg_name_str(op1), ", ", get_reg_name_str(op2));
 			this->gprs[dest] = (this->gprs[op1] == this->gprs[op2]);
 		break;
 
 		case Cmp_neq:
-			dprintln("\tcmp_neq ", get_reg_name_str(dest), ", ", get_reg_name_str(op1), ", ", get_reg_name_str(op2));
 			this->gprs[dest] = (this->gprs[op1] != this->gprs[op2]);
 		break;
 
-		case Load:
-			dprintln("\tload ", get_reg_name_str(dest), ", [", get_reg_name_str(op1), "]");
-			this->gprs[dest] = this->vmem_read( this->gprs[op1] );
+		case Load: {
+			const auto value = this->vmem_read<mode>( this->gprs[op1] );
+
+			if (!value) [[unlikely]]
+				return std::unexpected(value.error());
+
+			this->gprs[dest] = *value;
+		}
 		break;
 
-		case Store:
-			dprintln("\tstore [", get_reg_name_str(op1), "], ", get_reg_name_str(op2));
-			this->vmem_write(this->gprs[op1], this->gprs[op2]);
+		case Store: {
+			const auto stored = this->vmem_write<mode>(this->gprs[op1], this->gprs[op2]);
+
+			if (!stored) [[unlikely]]
+				return stored;
+		}
 		break;
 
 		case Syscall:
-			dprintln("\tsyscall");
 			OS::syscall();
+			this->after_os_call();
 		break;
 
-		default:
-			throw CpuException {
-				.type = CpuException::Type::GPFinvalidInstruction,
-				.vaddr = this->backup_pc
-				};
-	}
-}
-
-void Cpu::execute_i (const Instruction instruction)
-{
-	enum class OpcodeI : uint16_t {
-		Jump = 0,
-		Jump_cond = 1,
-		Mov = 3
-	};
-
-	const OpcodeI opcode = static_cast<OpcodeI>( instruction[{13, 2}] );
-	const uint16_t reg = instruction[{10, 3}];
-	const uint16_t imed = instruction[{0, 9}];
-
-	switch (opcode) {
-		using enum OpcodeI;
+		case Halt:
+			this->halt();
+		break;
 
 		case Jump:
-			dprintln("\tjump ", imed);
 			this->pc = imed;
 		break;
 
 		case Jump_cond:
-			dprintln("\tjump_cond ", get_reg_name_str(reg), ", ", imed);
 			if (this->gprs[reg] == 1)
 				this->pc = imed;
 		break;
 
 		case Mov:
-			dprintln("\tmov ", get_reg_name_str(reg), ", ", imed);
 			this->gprs[reg] = imed;
 		break;
 
-		default:
-			throw CpuException {
-				.type = CpuException::Type::GPFinvalidInstruction,
-				.vaddr = this->backup_pc
-				};
+		case Invalid:
+			return fault(CpuException::Type::GPFinvalidInstruction, this->backup_pc);
 	}
+
+	return {};
 }
 
-uint16_t Cpu::vmem_to_phys (const uint16_t vaddr, const MemAccessType access_type)
+void Cpu::trace_instruction (const uint16_t vaddr, const uint16_t word, const DecodedInstruction& instruction)
 {
-	uint16_t paddr;
+	const uint16_t dest = instruction.dest;
+	const uint16_t op1 = instruction.op1;
+	const uint16_t op2 = instruction.op2;
+	const uint16_t reg = instruction.dest;
+	const uint16_t imed = instruction.imed;
+
+	dprintln<Config::TraceLevel::Instruction>("\tPC = ", vaddr, " instr 0x", std::hex, word, std::dec, " binary ", word);
 
-	switch (this->vmem_mode) {
-		case VmemMode::Disabled:
-			paddr = vaddr;
+	switch (instruction.handler) {
+		using enum Handler;
+
+		case Add:
+			dprintln<Config::TraceLevel::Instruction>("\tadd ", RegName{dest}, ", ", RegName{op1}, ", ", RegName{op2});
 		break;
 
-		case VmemMode::BaseLimit:
-			if (vaddr >= this->vmem_size) {
-				throw CpuException {
-					.type = CpuException::Type::VmemPageFault,
-					.vaddr = vaddr
-					};
-			}
+		case Sub:
+			dprintln<Config::TraceLevel::Instruction>("\tsub ", RegName{dest}, ", ", RegName{op1}, ", ", RegName{op2});
+		break;
 
-			paddr = vaddr + this->vmem_paddr_base;
+		case Mul:
+			dprintln<Config::TraceLevel::Instruction>("\tmul ", RegName{dest}, ", ", RegName{op1}, ", ", RegName{op2});
 		break;
 
-		case VmemMode::Paging: {
-			mylib_assert_exception(this->page_table != nullptr)
+		case Div:
+			dprintln<Config::TraceLevel::Instruction>("\tdiv ", RegName{dest}, ", ", RegName{op1}, ", ", RegName{op2});
+		break;
 
-			PageTableEntry& pte_writeable = (*this->page_table)[vaddr >> Config::page_size_bits];
-			const PageTableEntry& pte = pte_writeable;
+		case Cmp_equal:
+			dprintln<Config::TraceLevel::Instruction>("\tcmp_equal ", RegName{dest}, ", ", RegName{op1}, ", ", RegName{op2});
+		break;
 
-			// first, do some protection checks
+		case Cmp_neq:
+			dprintln<Config::TraceLevel::Instruction>("\tcmp_neq ", RegName{dest}, ", ", RegName{op1}, ", ", RegName{op2});
+		break;
 
-			if (pte[PteField::Present] == 0) {
-				throw CpuException {
-					.type = CpuException::Type::VmemPageFault,
-					.vaddr = vaddr
-					};
-			}
+		case Load:
+			dprintln<Config::TraceLevel::Instruction>("\tload ", RegName{dest}, ", [", RegName{op1}, "]");
+		break;
 
-			if (access_type == MemAccessType::Read && pte[PteField::Readable] == 0) {
-				throw CpuException {
-					.type = CpuException::Type::VmemGPFnotReadable,
-					.vaddr = vaddr
-					};
-			}
+		case Store:
+			dprintln<Config::TraceLevel::Instruction>("\tstore [", RegName{op1}, "], ", RegName{op2});
+		break;
 
-			if (access_type == MemAccessType::Write && pte[PteField::Writable] == 0) {
-				throw CpuException {
-					.type = CpuException::Type::VmemGPFnotWritable,
-					.vaddr = vaddr
-					};
-			}
+		case Syscall:
+			dprintln<Config::TraceLevel::Instruction>("\tsyscall");
+		break;
 
-			if (access_type == MemAccessType::Execute && pte[PteField::Executable] == 0) {
-				throw CpuException {
-					.type = CpuException::Type::VmemGPFnotExecutable,
-					.vaddr = vaddr
-					};
-			}
+		case Halt:
+			dprintln<Config::TraceLevel::Instruction>("\thalt");
+		break;
 
-			// everything ok, perform the address translation
+		case Jump:
+			dprintln<Config::TraceLevel::Instruction>("\tjump ", imed);
+		break;
 
-			pte_writeable[PteField::Accessed] = 1;
+		case Jump_cond:
+			dprintln<Config::TraceLevel::Instruction>("\tjump_cond ", RegName{reg}, ", ", imed);
+		break;
 
-			if (access_type == MemAccessType::Write)
-				pte_writeable[PteField::Dirty] = 1;
+		case Mov:
+			dprintln<Config::TraceLevel::Instruction>("\tmov ", RegName{reg}, ", ", imed);
+		break;
 
-			paddr = Mylib::set_bits(
-				vaddr,
-				Config::page_size_bits,
-				Config::page_frame_id_bits,
-				pte[PteField::PhyFrameID]
-				);
-		}
+		case Invalid:
 		break;
 	}
+}
+
+// ---------------------------------------
+
+template <Cpu::VmemMode mode>
+Cpu::Result<void> Cpu::enter_block ()
+{
+	this->backup_pc = this->pc;
+
+	const auto translated = this->vmem_to_phys<mode>(this->pc, MemAccessType::Execute);
+
+	if (!translated) [[unlikely]]
+		return std::unexpected(translated.error());
+
+	const uint16_t paddr = *translated;
+
+	// the same check the interpreter gets from Memory
+	mylib_assert_exception(paddr < this->pmem_size_words)
+
+	auto& block = this->blocks[paddr];
+
+	if (!block) {
+		block = this->translate_block(paddr);
+		this->code_frames[paddr >> Config::page_size_bits] = true;
+	}
+
+	this->current_block = block.get();
+	this->block_pos = 0;
+	this->block_end = block->length;
+	this->block_vaddr = this->pc;
+
+	// the segment limit may end before the block does
+	if constexpr (mode == VmemMode::BaseLimit) {
+		if ((this->vmem_size - this->pc) < this->block_end)
+			this->block_end = this->vmem_size - this->pc;
+	}
+
+	return {};
+}
+
+std::unique_ptr<Cpu::TranslatedBlock> Cpu::translate_block (const uint16_t paddr) const
+{
+	auto block = std::make_unique<TranslatedBlock>();
+
+	block->paddr = paddr;
+	block->length = 0;
+
+	uint16_t addr = paddr;
+
+	do {
+		const uint16_t word = this->pmem_read(addr);
+		const DecodedInstruction& instruction = decode_table[word];
+
+		block->instructions[block->length] = instruction;
+		block->words[block->length] = word;
+		block->length++;
+		addr++;
+
+		if (instruction.handler == Handler::Jump
+			|| instruction.handler == Handler::Jump_cond
+			|| instruction.handler == Handler::Syscall
+			|| instruction.handler == Handler::Halt
+			|| instruction.handler == Handler::Invalid)
+			break;
+	} while ((addr & (Config::page_size - 1)) != 0);
+
+	return block;
+}
+
+// Threaded dispatch: each handler jumps straight to the handler of the
+// next instruction of the block.
+// Control transfers are always the last instruction of a block.
+// Every instruction takes one cycle, and the cycle count is kept exact
+// whenever the OS is called.
+
+template <Cpu::VmemMode mode>
+Cpu::Result<void> Cpu::execute_block (const uint32_t budget)
+{
+	static const void *const labels[] = {
+		&&op_add,
+		&&op_sub,
+		&&op_mul,
+		&&op_div,
+		&&op_cmp_equal,
+		&&op_cmp_neq,
+		&&op_load,
+		&&op_store,
+		&&op_syscall,
+		&&op_halt,
+		&&op_jump,
+		&&op_jump_cond,
+		&&op_mov,
+		&&op_invalid,
+	};
+
+	static_assert(std::size(labels) == std::to_underlying(Handler::Invalid) + 1);
+
+	const TranslatedBlock& block = *this->current_block;
+	const DecodedInstruction *const first = block.instructions.data() + this->block_pos;
+	const DecodedInstruction *const last = first + std::min<uint32_t>(budget, this->block_end - this->block_pos);
+	const DecodedInstruction *instr = first;
+
+	#define arch_block_dispatch() \
+		this->backup_pc = this->pc; \
+		if (trace_active<Config::TraceLevel::Instruction>()) \
+			trace_instruction(this->pc, block.words[instr - block.instructions.data()], *instr); \
+		this->pc++; \
+		goto *labels[ std::to_underlying(instr->handler) ];
+
+	#define arch_block_next() \
+		if (++instr == last) \
+			goto done; \
+		arch_block_dispatch()
+
+	arch_block_dispatch()
+
+op_add:
+	this->gprs[instr->dest] = this->gprs[instr->op1] + this->gprs[instr->op2];
+	arch_block_next()
+
+op_sub:
+	this->gprs[instr->dest] = this->gprs[instr->op1] - this->gprs[instr->op2];
+	arch_block_next()
+
+op_mul:
+	this->gprs[instr->dest] = this->gprs[instr->op1] * this->gprs[instr->op2];
+	arch_block_next()
+
+op_div:
+	this->gprs[instr->dest] = this->gprs[instr->op1] / this->gprs[instr->op2];
+	arch_block_next()
+
+op_cmp_equal:
+	this->gprs[instr->dest] = (this->gprs[instr->op1] == this->gprs[instr->op2]);
+	arch_block_next()
+
+op_cmp_neq:
+	this->gprs[instr->dest] = (this->gprs[instr->op1] != this->gprs[instr->op2]);
+	arch_block_next()
+
+op_load: {
+		const auto value = this->vmem_read<mode>( this->gprs[instr->op1] );
+
+		if (!value) [[unlikely]] {
+			this->computer.advance_cycles(instr - first);
+			return std::unexpected(value.error());
+		}
+
+		this->gprs[instr->dest] = *value;
+	}
+	arch_block_next()
+
+op_store: {
+		const auto stored = this->vmem_write<mode>(this->gprs[instr->op1], this->gprs[instr->op2]);
+
+		if (!stored) [[unlikely]] {
+			this->computer.advance_cycles(instr - first);
+			return std::unexpected(stored.error());
+		}
+	}
+
+	// the store may have overwritten this very block
+	if (this->current_block == nullptr) {
+		this->computer.advance_cycles((instr - first) + 1);
+		return {};
+	}
 
-	return paddr;
+	arch_block_next()
+
+op_syscall:
+	this->computer.advance_cycles(instr - first);
+	OS::syscall();
+	this->after_os_call();
+	this->computer.advance_cycles(1);
+	return {};
+
+op_halt:
+	this->halt();
+	instr++;
+	goto done;
+
+op_jump:
+	this->pc = instr->imed;
+	instr++;
+	goto done;
+
+op_jump_cond:
+	if (this->gprs[instr->dest] == 1)
+		this->pc = instr->imed;
+	instr++;
+	goto done;
+
+op_mov:
+	this->gprs[instr->dest] = instr->imed;
+	arch_block_next()
+
+op_invalid:
+	this->computer.advance_cycles(instr - first);
+	return fault(CpuException::Type::GPFinvalidInstruction, this->backup_pc);
+
+	#undef arch_block_dispatch
+	#undef arch_block_next
+
+done:
+	const uint32_t executed = instr - first;
+
+	this->block_pos += executed;
+	this->block_vaddr += executed;
+	this->computer.advance_cycles(executed);
+
+	return {};
+}
+
+void Cpu::invalidate_code_frame (const uint32_t frame)
+{
+	const uint32_t first = frame << Config::page_size_bits;
+
+	if (this->current_block != nullptr && (this->current_block->paddr >> Config::page_size_bits) == frame)
+		this->current_block = nullptr;
+
+	for (uint32_t paddr = first; paddr < (first + Config::page_size); paddr++)
+		this->blocks[paddr].reset();
+
+	this->code_frames[frame] = false;
+}
+
+void Cpu::invalidate_code (const uint16_t paddr, const uint32_t length)
+{
+	if (length == 0)
+		return;
+
+	this->memory.mark_dirty(paddr, length);
+
+	const uint32_t first = paddr >> Config::page_size_bits;
+	const uint32_t last = std::min<uint32_t>((paddr + length - 1) >> Config::page_size_bits, pmem_frames - 1);
+
+	for (uint32_t frame = first; frame <= last; frame++) {
+		if (this->code_frames[frame])
+			this->invalidate_code_frame(frame);
+	}
+}
+
+// ---------------------------------------
+
+template <Cpu::VmemMode mode>
+Cpu::Result<uint16_t> Cpu::vmem_to_phys (const uint16_t vaddr, const MemAccessType access_type)
+{
+	if constexpr (mode == VmemMode::Disabled)
+		return vaddr;
+	else if constexpr (mode == VmemMode::BaseLimit) {
+		if (vaddr >= this->vmem_size)
+			return fault(CpuException::Type::VmemPageFault, vaddr);
+
+		return vaddr + this->vmem_paddr_base;
+	}
+	else {
+		const uint16_t vpn = vaddr >> Config::page_size_bits;
+		const uint8_t access_bit = 1 << std::to_underlying(access_type);
+		TlbEntry& entry = this->tlb[vpn & (Config::tlb_entries - 1)];
+
+		if (entry.valid && entry.vpn == vpn && (entry.permissions & access_bit)) [[likely]] {
+			this->tlb_hits++;
+
+			if (access_type == MemAccessType::Write && !entry.dirty) {
+				(*this->page_table)[vpn][PteField::Dirty] = 1;
+				entry.dirty = true;
+			}
+
+			return entry.frame_paddr | (vaddr & (Config::page_size - 1));
+		}
+
+		this->tlb_misses++;
+
+		mylib_assert_exception(this->page_table != nullptr)
+
+		PageTableEntry& pte_writeable = (*this->page_table)[vpn];
+		const PageTableEntry& pte = pte_writeable;
+
+		// first, do some protection checks
+
+		if (pte[PteField::Present] == 0)
+			return fault(CpuException::Type::VmemPageFault, vaddr);
+
+		if (access_type == MemAccessType::Read && pte[PteField::Readable] == 0)
+			return fault(CpuException::Type::VmemGPFnotReadable, vaddr);
+
+		if (access_type == MemAccessType::Write && pte[PteField::Writable] == 0)
+			return fault(CpuException::Type::VmemGPFnotWritable, vaddr);
+
+		if (access_type == MemAccessType::Execute && pte[PteField::Executable] == 0)
+			return fault(CpuException::Type::VmemGPFnotExecutable, vaddr);
+
+		// everything ok, perform the address translation
+
+		pte_writeable[PteField::Accessed] = 1;
+
+		if (access_type == MemAccessType::Write)
+			pte_writeable[PteField::Dirty] = 1;
+
+		const uint16_t paddr = Mylib::set_bits(
+			vaddr,
+			Config::page_size_bits,
+			Config::page_frame_id_bits,
+			pte[PteField::PhyFrameID]
+			);
+
+		// cache the translation
+
+		entry.valid = true;
+		entry.dirty = (pte[PteField::Dirty] != 0);
+		entry.vpn = vpn;
+		entry.frame_paddr = paddr & ~(Config::page_size - 1);
+		entry.permissions = 0;
+
+		if (pte[PteField::Executable])
+			entry.permissions |= 1 << std::to_underlying(MemAccessType::Execute);
+
+		if (pte[PteField::Readable])
+			entry.permissions |= 1 << std::to_underlying(MemAccessType::Read);
+
+		if (pte[PteField::Writable])
+			entry.permissions |= 1 << std::to_underlying(MemAccessType::Write);
+
+		return paddr;
+	}
+}
+
+void Cpu::flush_tlb ()
+{
+	for (auto& entry: this->tlb)
+		entry.valid = false;
+}
+
+// The engine is chosen by the user, and the page table is memory of the OS
+// in the host, so both are kept as they are.
+// The translated blocks and the TLB are built again as the cpu runs.
+
+void Cpu::save (Snapshot::Writer& out) const
+{
+	out.begin(DeviceId::Cpu);
+	out.put_span(std::span<const uint16_t>(this->gprs));
+	out.put(this->pc);
+	out.put(this->backup_pc);
+	out.put(this->interrupt_code);
+	out.put(this->has_interrupt);
+	out.put(this->halted);
+	out.put(this->vmem_mode);
+	out.put(this->vmem_paddr_base);
+	out.put(this->vmem_size);
+	out.put(this->cpu_exception);
+	out.put(this->tlb_hits);
+	out.put(this->tlb_misses);
+}
+
+void Cpu::load (Snapshot::Reader& in)
+{
+	in.begin(DeviceId::Cpu);
+	in.get_span(std::span(this->gprs));
+	in.get(this->pc);
+	in.get(this->backup_pc);
+	in.get(this->interrupt_code);
+	in.get(this->has_interrupt);
+	in.get(this->halted);
+	const VmemMode vmem_mode = in.get<VmemMode>();
+	in.get(this->vmem_paddr_base);
+	in.get(this->vmem_size);
+	in.get(this->cpu_exception);
+	in.get(this->tlb_hits);
+	in.get(this->tlb_misses);
+
+	this->invalidate_code(0, Config::phys_mem_size_words);
+	this->current_block = nullptr;
+	this->set_vmem_mode(vmem_mode);
 }
 
 void Cpu::dump () const
@@ -2,6 +2,9 @@
 #define __ARQSIM_HEADER_ARCH_CPU_H__
 
 #include <array>
+#include <expected>
+#include <memory>
+#include <vector>
 
 #include <my-lib/std.h>
 #include <my-lib/macros.h>
@@ -10,7 +13,7 @@
 #include "../config.h"
 #include "device.h"
 #include "memory.h"
-#include "computer.h"
+#include "snapshot.h"
 
 namespace Arch {
 
@@ -25,6 +28,11 @@ public:
 		Paging         = 2
 	};
 
+	enum class Engine : uint16_t {
+		Interpreter    = 0, // reference interpreter, one fetch/decode per instruction
+		BlockCache     = 1, // translated basic blocks with threaded dispatch
+	};
+
 	enum class MemAccessType : uint16_t {
 		Execute        = 0,
 		Read           = 1,
@@ -58,29 +66,163 @@ public:
 	using PageTable = std::array<PageTableEntry, Config::ptes_per_table>;
 
 private:
-	using Instruction = Mylib::BitSet<16>;
+	// faults are returned instead of thrown, they are frequent under demand paging
+	template <typename T>
+	using Result = std::expected<T, CpuException>;
+
+	enum class Handler : uint8_t {
+		Add,
+		Sub,
+		Mul,
+		Div,
+		Cmp_equal,
+		Cmp_neq,
+		Load,
+		Store,
+		Syscall,
+		Halt,
+		Jump,
+		Jump_cond,
+		Mov,
+		Invalid
+	};
+
+	// Every 16-bit instruction word is decoded only once, at compile time.
+	// For I-type instructions, dest holds the reg field.
+	struct DecodedInstruction {
+		Handler handler;
+		uint8_t dest;
+		uint8_t op1;
+		uint8_t op2;
+		uint16_t imed;
+
+		constexpr bool is_valid () const
+		{
+			return this->handler != Handler::Invalid;
+		}
+	};
+
+	static constexpr DecodedInstruction decode (const uint16_t instruction);
+	static const std::array<DecodedInstruction, 1 << 16> decode_table;
+
+	// Straight-line code starting at a physical address.
+	// A block never crosses a page frame, so the same translation is valid for
+	// any virtual mapping of that frame.
+	struct TranslatedBlock {
+		uint16_t paddr;
+		uint16_t length;
+		std::array<DecodedInstruction, Config::page_size> instructions;
+		std::array<uint16_t, Config::page_size> words; // only used for tracing
+	};
+
+	static constexpr uint32_t pmem_frames = Config::phys_mem_size_words / Config::page_size;
+
+	// Direct-mapped cache of successful Paging translations.
+	// permissions has one bit per MemAccessType.
+	struct TlbEntry {
+		bool valid;
+		bool dirty;
+		uint8_t permissions;
+		uint16_t vpn;
+		uint16_t frame_paddr;
+	};
+
+	static_assert((Config::tlb_entries & (Config::tlb_entries - 1)) == 0);
+
+	Memory& memory;
 
 	std::array<uint16_t, Config::nregs> gprs;
 	InterruptCode interrupt_code;
 	bool has_interrupt = false;
+	bool halted = false; // sleeping until the next interrupt
 	uint16_t backup_pc;
 
+	Engine engine = Engine::Interpreter;
+
+	// Execution loop specialized for the current engine and VmemMode.
+	// Only changes when set_engine or set_vmem_mode are called.
+	using BurstFunction = void (Cpu::*) ();
+	BurstFunction burst;
+
+	// indexed by the physical address of the first instruction
+	std::vector<std::unique_ptr<TranslatedBlock>> blocks;
+
+	// frames that contain at least one translated block
+	std::array<bool, pmem_frames> code_frames;
+
+	// block being executed, and the next instruction to execute in it
+	TranslatedBlock *current_block = nullptr;
+	uint16_t block_pos;
+	uint16_t block_end;
+	uint16_t block_vaddr;
+
+	std::array<TlbEntry, Config::tlb_entries> tlb;
+	VmemMode vmem_mode = VmemMode::Disabled;
+	PageTable *page_table = nullptr;
+
 	MYLIB_OO_ENCAPSULATE_SCALAR(uint16_t, pc)
-	MYLIB_OO_ENCAPSULATE_SCALAR_INIT(VmemMode, vmem_mode, VmemMode::Disabled)
 	MYLIB_OO_ENCAPSULATE_SCALAR_INIT(uint16_t, vmem_paddr_base, 0)
 	MYLIB_OO_ENCAPSULATE_SCALAR_INIT(uint16_t, vmem_size, Config::phys_mem_size_words)
-	MYLIB_OO_ENCAPSULATE_PTR_INIT(PageTable*, page_table, nullptr)
 	MYLIB_OO_ENCAPSULATE_OBJ_READONLY(CpuException, cpu_exception)
 
 	MYLIB_OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint16_t, pmem_size_words, Config::phys_mem_size_words)
+	MYLIB_OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, tlb_hits, 0)
+	MYLIB_OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, tlb_misses, 0)
 
 public:
 	Cpu (Computer& computer);
 	~Cpu ();
 
-	void run_cycle () override final;
+	// runs until the next device event, or until the OS is called
+	void run_burst ();
+
 	void dump () const;
 
+	void save (Snapshot::Writer& out) const;
+	void load (Snapshot::Reader& in);
+
+	inline bool is_halted () const
+	{
+		return this->halted;
+	}
+
+	inline Engine get_engine () const
+	{
+		return this->engine;
+	}
+
+	inline void set_engine (const Engine engine)
+	{
+		this->engine = engine;
+		this->current_block = nullptr;
+		this->select_burst();
+	}
+
+	inline VmemMode get_vmem_mode () const
+	{
+		return this->vmem_mode;
+	}
+
+	inline void set_vmem_mode (const VmemMode vmem_mode)
+	{
+		this->vmem_mode = vmem_mode;
+		this->flush_tlb();
+		this->select_burst();
+	}
+
+	inline PageTable* get_page_table () const
+	{
+		return this->page_table;
+	}
+
+	inline void set_page_table (PageTable *page_table)
+	{
+		this->page_table = page_table;
+		this->flush_tlb();
+	}
+
+	void flush_tlb ();
+
 	inline uint16_t get_gpr (const uint8_t code) const
 	{
 		mylib_assert_exception(code < this->gprs.size())
@@ -95,28 +237,31 @@ public:
 
 	inline uint16_t pmem_read (const uint16_t paddr) const
 	{
-		return this->computer.get_memory()[paddr];
+		return this->memory[paddr];
 	}
 
 	inline void pmem_write (const uint16_t paddr, const uint16_t value)
 	{
-		this->computer.get_memory()[paddr] = value;
-	}
+		this->memory[paddr] = value;
+		this->memory.mark_dirty(paddr);
 
-	inline uint16_t read_io (const uint16_t port)
-	{
-		return this->computer.get_io_port(port).read(port);
+		if (this->code_frames[paddr >> Config::page_size_bits]) [[unlikely]]
+			this->invalidate_code_frame(paddr >> Config::page_size_bits);
 	}
 
+	// Must be called when physical memory is written without pmem_write.
+	// The pages written are also marked dirty in the memory.
+	void invalidate_code (const uint16_t paddr, const uint32_t length);
+
+	// defined in computer.h
+	inline uint16_t read_io (const uint16_t port);
+
 	inline uint16_t read_io (const IO_Port port)
 	{
 		return this->read_io(std::to_underlying(port));
 	}
 
-	inline void write_io (const uint16_t port, const uint16_t value)
-	{
-		this->computer.get_io_port(port).write(port, value);
-	}
+	inline void write_io (const uint16_t port, const uint16_t value);
 
 	inline void write_io (const IO_Port port, const uint16_t value)
 	{
@@ -128,27 +273,72 @@ public:
 	void turn_off ();
 
 private:
-	void execute_r (const Instruction instruction);
-	void execute_i (const Instruction instruction);
+	void deliver_interrupt ();
+	void deliver_fault (const CpuException& e);
+	void after_os_call ();
+	void halt ();
 
-	uint16_t vmem_to_phys (const uint16_t vaddr, const MemAccessType access_type);
+	template <VmemMode mode>
+	void interpret_burst ();
 
-	inline uint16_t vmem_read_instruction (const uint16_t vaddr)
+	template <VmemMode mode>
+	void translated_burst ();
+
+	template <VmemMode mode>
+	Result<void> interpret ();
+
+	template <VmemMode mode>
+	Result<void> execute (const DecodedInstruction& instruction);
+
+	static void trace_instruction (const uint16_t vaddr, const uint16_t word, const DecodedInstruction& instruction);
+
+	template <VmemMode mode>
+	Result<void> enter_block ();
+
+	std::unique_ptr<TranslatedBlock> translate_block (const uint16_t paddr) const;
+	template <VmemMode mode>
+	Result<void> execute_block (const uint32_t budget);
+
+	void invalidate_code_frame (const uint32_t frame);
+
+	void select_burst ();
+
+	template <VmemMode mode>
+	Result<uint16_t> vmem_to_phys (const uint16_t vaddr, const MemAccessType access_type);
+
+	template <VmemMode mode>
+	inline Result<uint16_t> vmem_read_instruction (const uint16_t vaddr)
 	{
-		const uint16_t paddr = this->vmem_to_phys(vaddr, MemAccessType::Execute);
-		return this->pmem_read(paddr);
+		const auto paddr = this->vmem_to_phys<mode>(vaddr, MemAccessType::Execute);
+
+		if (!paddr) [[unlikely]]
+			return std::unexpected(paddr.error());
+
+		return this->pmem_read(*paddr);
 	}
 
-	inline uint16_t vmem_read (const uint16_t vaddr)
+	template <VmemMode mode>
+	inline Result<uint16_t> vmem_read (const uint16_t vaddr)
 	{
-		const uint16_t paddr = this->vmem_to_phys(vaddr, MemAccessType::Read);
-		return this->pmem_read(paddr);
+		const auto paddr = this->vmem_to_phys<mode>(vaddr, MemAccessType::Read);
+
+		if (!paddr) [[unlikely]]
+			return std::unexpected(paddr.error());
+
+		return this->pmem_read(*paddr);
 	}
 
-	inline void vmem_write (const uint16_t vaddr, const uint16_t value)
+	template <VmemMode mode>
+	inline Result<void> vmem_write (const uint16_t vaddr, const uint16_t value)
 	{
-		const uint16_t paddr = this->vmem_to_phys(vaddr, MemAccessType::Write);
-		this->pmem_write(paddr, value);
+		const auto paddr = this->vmem_to_phys<mode>(vaddr, MemAccessType::Write);
+
+		if (!paddr) [[unlikely]]
+			return std::unexpected(paddr.error());
+
+		this->pmem_write(*paddr, value);
+
+		return {};
 	}
 };
 
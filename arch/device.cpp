@@ -1,6 +1,7 @@
 #include <array>
 
 #include "device.h"
+#include "computer.h"
 
 // ---------------------------------------
 
@@ -8,6 +9,13 @@ namespace Arch {
 
 // ---------------------------------------
 
+void Device::schedule (const uint64_t cycle)
+{
+	this->computer.schedule(this->device_id, cycle);
+}
+
+// ---------------------------------------
+
 const char* enum_class_to_str (const InterruptCode code)
 {
 	static constexpr auto strs = std::to_array<const char*>({
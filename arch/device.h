@@ -1,6 +1,10 @@
 #ifndef __ARQSIM_HEADER_ARCH_DEVICE_H__
 #define __ARQSIM_HEADER_ARCH_DEVICE_H__
 
+#include <limits>
+
+#include <cstdint>
+
 #include <my-lib/std.h>
 #include <my-lib/macros.h>
 
@@ -29,6 +33,9 @@ enum class IO_Port : uint16_t {
 	TerminalSet               = 0,   // write
 	TerminalUpload            = 1,   // write
 	TerminalReadTypedChar     = 2,   // read
+	TerminalPendingChars      = 3,   // read
+	TerminalUploadAddr        = 4,   // write
+	TerminalUploadLength      = 5,   // write
 	TimerInterruptCycles      = 10,  // read/write
 	TimerGetTimeSeconds       = 11,  // read
 	DiskCmd                   = 20,  // write
@@ -36,25 +43,98 @@ enum class IO_Port : uint16_t {
 	DiskFileID		          = 22,  // read/write
 	DiskState                 = 23,  // read
 	DiskError                 = 24,  // read
+	DiskDmaAddr               = 25,  // read/write
+	DiskDmaLength             = 26,  // read/write
+	DiskRequestPos            = 27,  // read/write
+	DiskRequestTag            = 28,  // read
+	DiskCompletedTag          = 29,  // read
+	DiskCompletedStatus       = 30,  // read
+	DiskCompletedWords        = 31,  // read
+	DiskCompletedCost         = 32,  // read
+	DiskCmdCost               = 33,  // read
 };
 
+// The devices of the Computer, in the order they are constructed.
+// Devices with events in the same cycle run in this order.
+
+enum class DeviceId : uint16_t {
+	Terminal         = 0,
+	Disk             = 1,
+	Timer            = 2,
+	Memory           = 3,
+	Cpu              = 4,
+
+	Count            = 5 // amount of devices
+};
+
+// Owner of each built-in port, resolved at compile time when the port is
+// a constant.
+// Returns DeviceId::Count for ports registered at runtime.
+
+constexpr DeviceId io_port_owner (const uint16_t port)
+{
+	switch (static_cast<IO_Port>(port)) {
+		using enum IO_Port;
+
+		case TerminalSet:
+		case TerminalUpload:
+		case TerminalReadTypedChar:
+		case TerminalPendingChars:
+		case TerminalUploadAddr:
+		case TerminalUploadLength:
+			return DeviceId::Terminal;
+
+		case TimerInterruptCycles:
+		case TimerGetTimeSeconds:
+			return DeviceId::Timer;
+
+		case DiskCmd:
+		case DiskData:
+		case DiskFileID:
+		case DiskState:
+		case DiskError:
+		case DiskDmaAddr:
+		case DiskDmaLength:
+		case DiskRequestPos:
+		case DiskRequestTag:
+		case DiskCompletedTag:
+		case DiskCompletedStatus:
+		case DiskCompletedWords:
+		case DiskCompletedCost:
+		case DiskCmdCost:
+			return DeviceId::Disk;
+
+		default:
+			return DeviceId::Count;
+	}
+}
+
 // ---------------------------------------
 
 class Computer;
 
+// Devices with events implement a non-virtual run_cycle(), called by the
+// Computer only at the cycles requested through schedule().
+
 class Device
 {
+public:
+	static constexpr uint64_t no_event = std::numeric_limits<uint64_t>::max();
+
 protected:
 	Computer& computer;
 
+private:
+	DeviceId device_id;
+
 public:
-	Device (Computer& computer)
-		: computer(computer)
+	Device (Computer& computer, const DeviceId device_id)
+		: computer(computer), device_id(device_id)
 	{
 	}
 
-	virtual ~Device () = default;
-	virtual void run_cycle () = 0;
+protected:
+	void schedule (const uint64_t cycle);
 };
 
 // ---------------------------------------
@@ -62,8 +142,8 @@ public:
 class IO_Device : public Device
 {
 public:
-	IO_Device (Computer& computer)
-		: Device(computer)
+	IO_Device (Computer& computer, const DeviceId device_id)
+		: Device(computer, device_id)
 	{
 	}
 
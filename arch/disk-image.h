@@ -0,0 +1,71 @@
+#ifndef __ARQSIM_HEADER_ARCH_DISK_IMAGE_H__
+#define __ARQSIM_HEADER_ARCH_DISK_IMAGE_H__
+
+#include <string_view>
+
+#include <cstdint>
+
+// Layout of a disk image, a single host file with all the guest files.
+// Shared by the Disk device and tools/pack-disk-image.cpp.
+// Everything is in the host byte order, like the guest binaries.
+//
+// Header
+// Buckets: nbuckets uint32_t, index of the first entry of each bucket
+// Entries: nentries Entry
+// Names: the names of the entries, not null terminated
+// Data: the contents of each file, contiguous
+
+namespace Arch {
+namespace DiskImage {
+
+// ---------------------------------------
+
+inline constexpr char magic[8] = { 'A', 'R', 'Q', 'D', 'I', 'S', 'K', 0 };
+
+inline constexpr uint32_t version = 1;
+
+// ends a bucket chain
+inline constexpr uint32_t no_entry = 0xFFFFFFFF;
+
+// the data of each file starts aligned to this
+inline constexpr uint32_t data_alignment = 16;
+
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nbuckets; // power of 2
+	uint32_t nentries;
+	uint32_t buckets_offset; // all offsets are from the start of the image
+	uint32_t entries_offset;
+	uint32_t names_offset;
+};
+
+struct Entry {
+	uint32_t hash;
+	uint32_t next; // next entry in the same bucket, or no_entry
+	uint32_t name_offset; // from names_offset
+	uint32_t name_length;
+	uint32_t data_offset;
+	uint32_t data_size;
+};
+
+// FNV-1a, the bucket of a name is hash(name) & (nbuckets - 1)
+
+constexpr uint32_t hash (const std::string_view name)
+{
+	uint32_t h = 2166136261u;
+
+	for (const char c: name) {
+		h ^= static_cast<uint8_t>(c);
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+// ---------------------------------------
+
+} // end namespace
+} // end namespace
+
+#endif
@@ -1,4 +1,7 @@
 #include <limits>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
 
 #include "disk.h"
 #include "computer.h"
@@ -10,39 +13,123 @@ namespace Arch {
 
 // ---------------------------------------
 
-Disk::Disk (Computer& computer)
-	: IO_Device(computer)
+Disk::Disk (Computer& computer, const Settings& settings)
+	: IO_Device(computer, DeviceId::Disk),
+	  host_io(Config::disk_host_io_threads)
 {
-	this->computer.set_io_port(IO_Port::DiskCmd, this);
-	this->computer.set_io_port(IO_Port::DiskData, this);
-	this->computer.set_io_port(IO_Port::DiskFileID, this);
-	this->computer.set_io_port(IO_Port::DiskState, this);
-	this->computer.set_io_port(IO_Port::DiskError, this);
+	if (!settings.image_fname.empty())
+		this->mount_image(settings.image_fname);
+
+	if (!settings.profile_fname.empty())
+		this->latency = load_latency_profile(settings.profile_fname);
 }
 
 Disk::~Disk ()
 {
-	for (auto& it: this->file_descriptors) {
-		auto& d = it.second;
-		if (d.file.is_open())
-			d.file.close();
-	}
+	this->wait_host_reads();
+
+	// don't lose what the guest wrote
+	for (auto& it: this->file_descriptors)
+		this->flush_file(it.second);
 }
 
 void Disk::run_cycle ()
+{
+	const uint64_t cycle = this->computer.get_cycle();
+
+	if (this->cmd_event <= cycle) {
+		this->cmd_event = no_event;
+		this->run_cmd_event();
+	}
+
+	if (this->queue_event <= cycle) {
+		this->queue_event = no_event;
+		this->run_queue_event();
+	}
+
+	this->schedule_next_event();
+}
+
+// the command completes after cycles
+
+void Disk::start_cmd (const uint64_t cycles)
+{
+	this->cmd_cost = cycles;
+	this->cmd_event = this->computer.get_cycle() + cycles + 1;
+	this->schedule_next_event();
+}
+
+// Moves the head to the end of the data, and returns the cycles it takes.
+
+uint64_t Disk::charge (const uint64_t disk_addr, const uint32_t size_bytes, const uint32_t cycles_per_word)
+{
+	const LatencyProfile& p = this->latency;
+	const uint64_t distance = (disk_addr > this->head_pos) ? (disk_addr - this->head_pos) : (this->head_pos - disk_addr);
+	Cost cost;
+
+	cost.controller = p.controller_cycles;
+
+	if (distance > 0) {
+		cost.seek = p.seek_min_cycles + (distance / 1024) * p.seek_cycles_per_kb;
+
+		if (p.seek_max_cycles > 0)
+			cost.seek = std::min<uint64_t>(cost.seek, p.seek_max_cycles);
+
+		cost.rotation = p.rotation_cycles / 2;
+	}
+
+	cost.transfer = static_cast<uint64_t>((size_bytes + 1) / 2) * cycles_per_word;
+
+	this->head_pos = disk_addr + size_bytes;
+	this->total_cost += cost;
+	this->operations++;
+
+	return cost.total();
+}
+
+void Disk::schedule_next_event ()
+{
+	const uint64_t cycle = std::min(this->cmd_event, this->queue_event);
+
+	if (cycle != no_event)
+		this->schedule(cycle);
+}
+
+// scheduled when the latency of the current command is over
+
+void Disk::run_cmd_event ()
 {
 	switch (state) {
 		using enum State;
 
 		case ReadingFile:
-			if (this->count >= Config::disk_interrupt_cycles) {
-				if (this->computer.get_cpu().interrupt(InterruptCode::Disk)) {
-					this->count = 0;
-					this->state = State::UploadingFileSize;
-				}
+			this->finish_host_read();
+
+			if (this->computer.get_cpu().interrupt(InterruptCode::Disk)) {
+				this->count = 0;
+				this->state = State::UploadingFileSize;
 			}
 			else
-				this->count++;
+				this->cmd_event = this->computer.get_cycle() + 1;
+		break;
+
+		// the data is in memory when the OS handles the interrupt
+		case ReadingFileDma:
+			this->finish_host_read();
+
+			if (this->computer.get_cpu().interrupt(InterruptCode::Disk)) {
+				this->dma_transfer();
+				this->state = State::Idle;
+			}
+			else
+				this->cmd_event = this->computer.get_cycle() + 1;
+		break;
+
+		case WritingFile:
+			if (this->computer.get_cpu().interrupt(InterruptCode::Disk))
+				this->state = State::Idle;
+			else
+				this->cmd_event = this->computer.get_cycle() + 1;
 		break;
 
 		default: ;
@@ -80,6 +167,52 @@ uint16_t Disk::read (const uint16_t port)
 			r = std::to_underlying(this->error);
 		break;
 
+		case DiskDmaAddr:
+			r = this->dma_paddr;
+		break;
+
+		case DiskDmaLength:
+			r = this->dma_length;
+		break;
+
+		case DiskRequestPos:
+			r = this->request_pos;
+		break;
+
+		case DiskRequestTag:
+			r = this->last_request_tag;
+		break;
+
+		// pops the oldest completion, its status and words can then be read
+		case DiskCompletedTag:
+			if (this->completions.empty())
+				this->last_completion = Completion();
+			else {
+				this->last_completion = this->completions.front();
+				this->completions.pop_front();
+			}
+
+			r = this->last_completion.tag;
+		break;
+
+		case DiskCompletedStatus:
+			r = std::to_underlying(this->last_completion.status);
+		break;
+
+		case DiskCompletedWords:
+			r = this->last_completion.words;
+		break;
+
+		// costs larger than 16 bits read as 0xFFFF
+
+		case DiskCompletedCost:
+			r = std::min<uint64_t>(this->last_completion.cost, std::numeric_limits<uint16_t>::max());
+		break;
+
+		case DiskCmdCost:
+			r = std::min<uint64_t>(this->cmd_cost, std::numeric_limits<uint16_t>::max());
+		break;
+
 		default:
 			mylib_throw_exception_msg("Disk read invalid port ", port);
 	}
@@ -116,6 +249,18 @@ void Disk::write (const uint16_t port, const uint16_t value)
 		}
 		break;
 
+		case DiskDmaAddr:
+			this->dma_paddr = value;
+		break;
+
+		case DiskDmaLength:
+			this->dma_length = value;
+		break;
+
+		case DiskRequestPos:
+			this->request_pos = value;
+		break;
+
 		default:
 			mylib_throw_exception_msg("Disk read invalid port ", port);
 	}
@@ -125,6 +270,12 @@ void Disk::process_cmd (const uint16_t cmd_)
 {
 	const Cmd cmd = static_cast<Cmd>(cmd_);
 
+	// the queue doesn't depend on the state machine
+	if (cmd == Cmd::QueueReadDma) {
+		this->queue_request();
+		return;
+	}
+
 	if (this->state != State::Idle)
 		return;
 
@@ -138,27 +289,29 @@ void Disk::process_cmd (const uint16_t cmd_)
 		break;
 
 		case OpenFile: {
-			// check if file is already open
-
-			for (const auto& it: this->file_descriptors) {
-				if (it.second.fname == this->fname) {
-					this->current_file_descriptor = nullptr;
-					this->error = Error::FileAlreadyOpen;
-					return;
-				}
+			if (this->open_fnames.contains(this->fname)) {
+				this->current_file_descriptor = nullptr;
+				this->error = Error::FileAlreadyOpen;
+				return;
 			}
 
 			FileDescriptor desc;
-			desc.id = this->next_id++;
-			mylib_assert_exception(desc.id < std::numeric_limits<uint16_t>::max())
-			desc.fname = std::move(this->fname);
-			desc.file.open(desc.fname.data(), std::ios::binary | std::ios_base::in);
+			desc.fname = this->fname;
 
-			if (!desc.file.is_open()) {
+			if (!this->map_file(desc)) {
 				this->current_file_descriptor = nullptr;
 				this->error = Error::CannotOpenFile;
 				return;
 			}
+
+			desc.id = this->next_id++;
+			mylib_assert_exception(desc.id < std::numeric_limits<uint16_t>::max())
+
+			// host files don't share a disk, each one is far from the others
+			if (!desc.in_image)
+				desc.disk_base = static_cast<uint64_t>(desc.id) << 32;
+
+			this->open_fnames.insert(desc.fname);
 			
 			auto pair = this->file_descriptors.insert(std::make_pair(desc.id, std::move(desc)));
 			
@@ -177,44 +330,156 @@ void Disk::process_cmd (const uint16_t cmd_)
 				return;
 			}
 
+			if (this->current_file_descriptor->pending_requests > 0) {
+				this->error = Error::FileBusy;
+				return;
+			}
+
 			const auto it = this->file_descriptors.find(this->current_file_descriptor->id);
 
 			mylib_assert_exception(it != this->file_descriptors.end())
 
 			FileDescriptor& desc = *this->current_file_descriptor;
+			const bool flushed = this->flush_file(desc);
 			desc.file.close();
 
+			this->open_fnames.erase(desc.fname);
 			this->file_descriptors.erase(it);
 			
 			this->current_file_descriptor = nullptr;
-			this->error = Error::NoError;
+			this->error = flushed ? Error::NoError : Error::CannotWriteFile;
 		}
 		break;
 
-		case ReadFile:
+		case ReadFile: {
 			if (this->current_file_descriptor == nullptr) {
 				this->error = Error::InvalidFileDescriptor;
 				return;
 			}
 
+			if (!this->flush_file(*this->current_file_descriptor)) {
+				this->error = Error::CannotWriteFile;
+				return;
+			}
+
+			const uint64_t cycles = this->start_transfer(this->data_written, this->latency.pio_cycles_per_word);
+
 			this->state = State::ReadingFile;
-			this->count = 0;
 			this->error = Error::NoError;
+
+			this->start_cmd(cycles);
+		}
 		break;
 
-		case GetFileSize: {
+		// The file is read in the host byte order, like Lib::load_from_disk_to_16bit_buffer.
+		// When done, the amount of words transferred can be read from DiskData.
+		case ReadFileDma: {
 			if (this->current_file_descriptor == nullptr) {
 				this->error = Error::InvalidFileDescriptor;
 				return;
 			}
 
-			const auto size = get_file_size(this->current_file_descriptor->file);
+			if ((static_cast<uint32_t>(this->dma_paddr) + this->dma_length) > Config::phys_mem_size_words) {
+				this->error = Error::InvalidDmaRange;
+				return;
+			}
 
-			this->data_result = size;
+			if (!this->flush_file(*this->current_file_descriptor)) {
+				this->error = Error::CannotWriteFile;
+				return;
+			}
+
+			const FileDescriptor& desc = *this->current_file_descriptor;
+			const uint32_t remaining_bytes = (desc.pos > desc.data.size()) ? 0 : (desc.data.size() - desc.pos);
+			const uint32_t remaining_words = (remaining_bytes + 1) / 2;
+
+			this->dma_transfer_words = std::min<uint32_t>(this->dma_length, remaining_words);
+
+			const uint64_t cycles = this->start_transfer(this->dma_transfer_words * sizeof(uint16_t), this->latency.cycles_per_word);
+
+			this->state = State::ReadingFileDma;
 			this->error = Error::NoError;
+
+			this->start_cmd(cycles);
 		}
 		break;
 
+		case GetFileSize:
+			if (this->current_file_descriptor == nullptr) {
+				this->error = Error::InvalidFileDescriptor;
+				return;
+			}
+
+			this->data_result = get_file_size(*this->current_file_descriptor);
+			this->error = Error::NoError;
+		break;
+
+		// the position is the value written to DiskData, in bytes
+		case SeekFilePos:
+			if (this->current_file_descriptor == nullptr) {
+				this->error = Error::InvalidFileDescriptor;
+				return;
+			}
+
+			if (this->data_written > get_file_size(*this->current_file_descriptor)) {
+				this->error = Error::InvalidFilePos;
+				return;
+			}
+
+			this->current_file_descriptor->pos = this->data_written;
+			this->error = Error::NoError;
+		break;
+
+		// The guest writes the amount of bytes to DiskData, then sends WriteFile,
+		// and then writes every byte to DiskData. The Disk interrupt tells the
+		// write is complete, and the amount of bytes written can be read from DiskData.
+		case WriteFile:
+			if (this->current_file_descriptor == nullptr) {
+				this->error = Error::InvalidFileDescriptor;
+				return;
+			}
+
+			// the disk image is read-only
+			if (this->current_file_descriptor->in_image) {
+				this->error = Error::CannotWriteFile;
+				return;
+			}
+
+			if (this->current_file_descriptor->pending_requests > 0) {
+				this->error = Error::FileBusy;
+				return;
+			}
+
+			// better now than losing the bytes when the cache is flushed
+			if (!can_write_file(*this->current_file_descriptor)) {
+				this->error = Error::CannotWriteFile;
+				return;
+			}
+
+			this->count = 0;
+			this->error = Error::NoError;
+			this->write_file_descriptor = this->current_file_descriptor;
+
+			if (this->data_written > 0)
+				this->state = State::DownloadingFile;
+			else {
+				this->data_result = 0;
+				this->state = State::WritingFile;
+
+				const FileDescriptor& desc = *this->write_file_descriptor;
+				this->start_cmd(this->charge(desc.disk_base + desc.pos, 0, this->latency.pio_cycles_per_word));
+			}
+		break;
+
+		case FlushFile:
+			if (this->current_file_descriptor == nullptr) {
+				this->error = Error::InvalidFileDescriptor;
+				return;
+			}
+
+			this->error = this->flush_file(*this->current_file_descriptor) ? Error::NoError : Error::CannotWriteFile;
+		break;
+
 		default:
 			mylib_throw_exception_msg("Disk invalid command ", cmd_);
 	}
@@ -238,20 +503,7 @@ uint16_t Disk::process_data_read ()
 				break;
 			}
 
-			// here, we actually read the file
-
-			const auto size_to_read = this->data_written;
-
-			this->buffer.resize(size_to_read);
-
-			// now, read the file
-
-			auto& file = this->current_file_descriptor->file;
-
-			file.read(reinterpret_cast<char*>(this->buffer.data()), size_to_read);
-
-			const auto amount_read = file.gcount();
-			this->buffer.resize(amount_read);
+			const auto amount_read = this->transfer.size();
 			r = amount_read;
 
 			this->error = Error::NoError;
@@ -266,11 +518,11 @@ uint16_t Disk::process_data_read ()
 		break;
 
 		case UploadingFile:
-			mylib_assert_exception(this->count < this->buffer.size())
+			mylib_assert_exception(this->count < this->transfer.size())
 			
-			r = this->buffer[this->count++];
+			r = this->transfer[this->count++];
 
-			if (this->count == this->buffer.size())
+			if (this->count == this->transfer.size())
 				this->state = State::Idle;
 		break;
 
@@ -300,19 +552,723 @@ void Disk::process_data_write (const uint16_t value)
 		}
 		break;
 
+		// files are only closed in Idle, so the file is still open
+		case DownloadingFile:
+			this->write_byte(*this->write_file_descriptor, static_cast<uint8_t>(value));
+
+			if (++this->count == this->data_written) {
+				const FileDescriptor& desc = *this->write_file_descriptor;
+
+				this->data_result = this->count;
+				this->state = State::WritingFile;
+				this->start_cmd(this->charge(desc.disk_base + desc.pos - this->count, this->count, this->latency.pio_cycles_per_word));
+			}
+		break;
+
 		default:
 			mylib_throw_exception_msg("Disk invalid state ", static_cast<uint16_t>(this->state));
 	}
 }
 
-std::fstream::pos_type Disk::get_file_size (std::fstream& file)
+// Called when the read command is accepted, the file position moves right away.
+// The file can't be closed until the read is done, since commands are
+// ignored out of State::Idle.
+// Returns the cycles the read takes.
+
+uint64_t Disk::start_transfer (const uint32_t size_bytes, const uint32_t cycles_per_word)
+{
+	FileDescriptor& desc = *this->current_file_descriptor;
+	const uint32_t size = (desc.pos > desc.data.size()) ? 0 : std::min<uint32_t>(size_bytes, desc.data.size() - desc.pos);
+	const uint64_t cycles = this->charge(desc.disk_base + desc.pos, size, cycles_per_word);
+
+	this->transfer = desc.data.subspan(desc.pos, size);
+	this->transfer_id = desc.id;
+	desc.pos += size;
+
+	this->host_read = this->prefetch(this->transfer);
+
+	return cycles;
+}
+
+// Touches the pages of data in host_io, so a cold file is brought from
+// the host disk while the simulated latency elapses.
+
+std::future<void> Disk::prefetch (const std::span<const uint8_t> data)
+{
+	return this->host_io.submit([data] {
+		constexpr uint32_t host_page_size = 4096;
+		[[maybe_unused]] volatile uint8_t touch;
+
+		for (uint32_t i = 0; i < data.size(); i += host_page_size)
+			touch = data[i];
+	});
+}
+
+// Waits for the host read, in case it is slower than the simulated latency.
+// Does nothing if it was already finished.
+
+void Disk::finish_host_read ()
+{
+	if (this->host_read.valid())
+		this->host_read.get();
+}
+
+// the host reads may still be using a file
+
+void Disk::wait_host_reads ()
+{
+	if (this->host_read.valid())
+		this->host_read.wait();
+
+	for (auto& request: this->queue) {
+		if (request.host_read.valid())
+			request.host_read.wait();
+	}
+
+	if (this->request_active && this->active_request.host_read.valid())
+		this->active_request.host_read.wait();
+}
+
+void Disk::dma_transfer ()
+{
+	this->copy_to_memory(this->transfer, this->dma_paddr, this->dma_transfer_words);
+
+	this->data_result = (this->transfer.size() + 1) / 2;
+}
+
+void Disk::copy_to_memory (const std::span<const uint8_t> data, const uint16_t paddr, const uint16_t words)
+{
+	uint16_t *dest = this->computer.get_memory().get_raw() + paddr;
+
+	// an odd file size leaves the last word half filled
+	if (words > 0)
+		dest[words - 1] = 0;
+
+	std::ranges::copy(data, reinterpret_cast<uint8_t*>(dest));
+
+	this->computer.get_cpu().invalidate_code(paddr, words);
+}
+
+// The request reads DiskDmaLength words from the current file at DiskRequestPos
+// to physical memory at DiskDmaAddr. Its tag can then be read from DiskRequestTag,
+// or 0 if it was refused, with the reason in DiskError.
+// A position past the end of the file is only reported when the request completes.
+// Refused with FileBusy while a WriteFile is receiving the bytes of the same file.
+
+void Disk::queue_request ()
 {
-	const auto pos = file.tellg();
-	file.seekg(0, std::ios::end);
-	const auto size = file.tellg();
-	file.seekg(pos);
+	this->last_request_tag = 0;
+
+	if (this->current_file_descriptor == nullptr) {
+		this->error = Error::InvalidFileDescriptor;
+		return;
+	}
+
+	if ((static_cast<uint32_t>(this->dma_paddr) + this->dma_length) > Config::phys_mem_size_words) {
+		this->error = Error::InvalidDmaRange;
+		return;
+	}
+
+	const uint32_t in_flight = this->queue.size() + (this->request_active ? 1 : 0) + this->completions.size();
+
+	if (in_flight >= Config::disk_queue_size) {
+		this->error = Error::QueueFull;
+		return;
+	}
+
+	FileDescriptor& desc = *this->current_file_descriptor;
+
+	// a full write cache would be flushed while the prefetch reads the mapping
+	if (this->state == State::DownloadingFile && this->write_file_descriptor == &desc) {
+		this->error = Error::FileBusy;
+		return;
+	}
+
+	// The mapping must not change while the request waits, and only a flush
+	// changes it. WriteFile is refused while pending_requests > 0, and the
+	// flush here empties the cache, so nothing flushes again until it completes.
+	if (!this->flush_file(desc)) {
+		this->error = Error::CannotWriteFile;
+		return;
+	}
+
+	Request request;
+	request.tag = this->next_request_tag;
+	request.desc = &desc;
+	request.pos = this->request_pos;
+	request.paddr = this->dma_paddr;
+	request.length = this->dma_length;
+	request.disk_addr = desc.disk_base + request.pos;
+
+	if (request.pos < desc.data.size())
+		request.host_read = this->prefetch(desc.data.subspan(request.pos, std::min<uint32_t>(request.length * sizeof(uint16_t), desc.data.size() - request.pos)));
+
+	this->next_request_tag = (this->next_request_tag == std::numeric_limits<uint16_t>::max()) ? 1 : (this->next_request_tag + 1);
+	this->last_request_tag = request.tag;
+
+	desc.pending_requests++;
+	this->queue.push_back(std::move(request));
+	this->error = Error::NoError;
+
+	if (!this->request_active) {
+		this->start_next_request();
+		this->schedule_next_event();
+	}
+}
+
+// C-LOOK, takes the closest request ahead of the head, or the lowest one
+
+void Disk::start_next_request ()
+{
+	if (this->request_active || this->queue.empty())
+		return;
+
+	const auto by_addr = [] (const Request& a, const Request& b) {
+		return a.disk_addr < b.disk_addr;
+	};
+
+	auto it = std::ranges::min_element(this->queue, by_addr);
+	auto ahead = this->queue.end();
+
+	for (auto r = this->queue.begin(); r != this->queue.end(); ++r) {
+		if (r->disk_addr >= this->head_pos && (ahead == this->queue.end() || r->disk_addr < ahead->disk_addr))
+			ahead = r;
+	}
+
+	if (ahead != this->queue.end())
+		it = ahead;
+
+	this->active_request = std::move(*it);
+	this->queue.erase(it);
+	this->request_active = true;
+
+	Request& request = this->active_request;
+	const uint32_t size = request.desc->data.size();
+	const uint32_t size_bytes = (request.pos > size) ? 0 : std::min<uint32_t>(request.length * sizeof(uint16_t), size - request.pos);
+
+	request.cost = this->charge(request.disk_addr, size_bytes, this->latency.cycles_per_word);
+
+	this->request_done_cycle = this->computer.get_cycle() + request.cost + 1;
+	this->queue_event = std::min(this->queue_event, this->request_done_cycle);
+}
+
+void Disk::complete_request ()
+{
+	Request& request = this->active_request;
+	FileDescriptor& desc = *request.desc;
+	Completion completion;
+
+	if (request.host_read.valid())
+		request.host_read.get();
+
+	completion.tag = request.tag;
+	completion.cost = request.cost;
+
+	if (request.pos > desc.data.size())
+		completion.status = Error::InvalidFilePos;
+	else {
+		const uint32_t remaining_bytes = desc.data.size() - request.pos;
+		const uint16_t words = std::min<uint32_t>(request.length, (remaining_bytes + 1) / 2);
+		const auto data = desc.data.subspan(request.pos, std::min<uint32_t>(words * sizeof(uint16_t), remaining_bytes));
+
+		this->copy_to_memory(data, request.paddr, words);
+
+		completion.status = Error::NoError;
+		completion.words = words;
+	}
+
+	desc.pending_requests--;
+	this->completions.push_back(completion);
+	this->completion_interrupt = true;
+	this->request_active = false;
+}
+
+// A single interrupt may announce several completions,
+// the OS should read DiskCompletedTag until it returns 0.
+
+void Disk::run_queue_event ()
+{
+	const uint64_t cycle = this->computer.get_cycle();
+
+	if (this->request_active && this->request_done_cycle <= cycle)
+		this->complete_request();
+
+	this->start_next_request();
+
+	if (this->completion_interrupt && this->computer.get_cpu().interrupt(InterruptCode::Disk))
+		this->completion_interrupt = false;
+
+	if (this->request_active)
+		this->queue_event = std::min(this->queue_event, this->request_done_cycle);
+
+	if (this->completion_interrupt)
+		this->queue_event = std::min(this->queue_event, cycle + 1);
+}
+
+// The cache holds a single contiguous range of the file.
+// It is flushed when full, or when the guest writes somewhere else.
+
+void Disk::write_byte (FileDescriptor& desc, const uint8_t value)
+{
+	const bool contiguous = (desc.pos == desc.write_cache_pos + desc.write_cache.size());
+
+	if (desc.write_cache.size() == Config::disk_write_cache_size || !contiguous) {
+		if (!this->flush_file(desc))
+			this->error = Error::CannotWriteFile;
+	}
+
+	if (desc.write_cache.empty()) {
+		desc.write_cache.reserve(Config::disk_write_cache_size);
+		desc.write_cache_pos = desc.pos;
+	}
+
+	desc.write_cache.push_back(value);
+	desc.pos++;
+}
+
+// Sends the write cache to the host file in a single write, and maps the
+// file again, so reads see the new data and size.
+// Returns false if the host file cannot be written, the cached bytes are lost
+// and the position goes back to the end of the file.
+// If the file cannot be mapped again, it is left empty.
+
+bool Disk::flush_file (FileDescriptor& desc)
+{
+	if (desc.write_cache.empty())
+		return true;
+
+	// the mapping is closed first, some hosts don't write to mapped files
+	desc.file.close();
+
+	std::fstream host_file(desc.fname, std::ios::binary | std::ios::in | std::ios::out);
+	bool ok = host_file.is_open();
+
+	if (ok) {
+		host_file.seekp(desc.write_cache_pos);
+		host_file.write(reinterpret_cast<const char*>(desc.write_cache.data()), desc.write_cache.size());
+		ok = host_file.good();
+		host_file.close();
+	}
+
+	desc.write_cache.clear();
+
+	if (desc.file.open(desc.fname))
+		desc.data = desc.file.get_span();
+	else {
+		desc.data = {};
+		ok = false;
+	}
+
+	if (!ok)
+		desc.pos = std::min<uint32_t>(desc.pos, desc.data.size());
+
+	return ok;
+}
+
+// the host file may be read-only, or gone
+
+bool Disk::can_write_file (const FileDescriptor& desc)
+{
+	std::fstream host_file(desc.fname, std::ios::binary | std::ios::in | std::ios::out);
+
+	return host_file.is_open();
+}
+
+// includes the bytes still in the write cache
+
+uint32_t Disk::get_file_size (const FileDescriptor& desc)
+{
+	if (desc.write_cache.empty())
+		return desc.data.size();
+
+	return std::max<uint32_t>(desc.data.size(), desc.write_cache_pos + desc.write_cache.size());
+}
+
+// Maps the image and checks that every entry lies inside it,
+// so OpenFile and the reads don't need to check anything.
+
+void Disk::mount_image (const std::string_view image_fname)
+{
+	if (!this->image.open(image_fname))
+		mylib_throw_exception_msg("cannot open disk image ", image_fname);
+
+	const auto bytes = this->image.get_span();
+
+	const auto in_image = [&bytes] (const uint64_t offset, const uint64_t size) -> bool {
+		return (offset + size) <= bytes.size();
+	};
+
+	mylib_assert_exception_msg(in_image(0, sizeof(DiskImage::Header)), "disk image ", image_fname, " is too small")
+
+	const auto *header = reinterpret_cast<const DiskImage::Header*>(bytes.data());
+
+	mylib_assert_exception_msg(std::ranges::equal(header->magic, DiskImage::magic), image_fname, " is not a disk image")
+	mylib_assert_exception_msg(header->version == DiskImage::version, "disk image ", image_fname, " has unsupported version ", header->version)
+	mylib_assert_exception_msg(header->nbuckets > 0 && (header->nbuckets & (header->nbuckets - 1)) == 0, "disk image ", image_fname, " is corrupted")
+	mylib_assert_exception_msg(in_image(header->buckets_offset, static_cast<uint64_t>(header->nbuckets) * sizeof(uint32_t)), "disk image ", image_fname, " is corrupted")
+	mylib_assert_exception_msg(in_image(header->entries_offset, static_cast<uint64_t>(header->nentries) * sizeof(DiskImage::Entry)), "disk image ", image_fname, " is corrupted")
+	mylib_assert_exception_msg((header->buckets_offset % alignof(uint32_t)) == 0 && (header->entries_offset % alignof(DiskImage::Entry)) == 0, "disk image ", image_fname, " is corrupted")
+
+	this->image_buckets = reinterpret_cast<const uint32_t*>(bytes.data() + header->buckets_offset);
+	this->image_entries = reinterpret_cast<const DiskImage::Entry*>(bytes.data() + header->entries_offset);
+	this->image_names = reinterpret_cast<const char*>(bytes.data() + header->names_offset);
+
+	for (uint32_t i = 0; i < header->nbuckets; i++)
+		mylib_assert_exception_msg(this->image_buckets[i] == DiskImage::no_entry || this->image_buckets[i] < header->nentries, "disk image ", image_fname, " is corrupted")
+
+	for (uint32_t i = 0; i < header->nentries; i++) {
+		const DiskImage::Entry& entry = this->image_entries[i];
+
+		mylib_assert_exception_msg(entry.next == DiskImage::no_entry || entry.next < header->nentries, "disk image ", image_fname, " is corrupted")
+		mylib_assert_exception_msg(in_image(static_cast<uint64_t>(header->names_offset) + entry.name_offset, entry.name_length), "disk image ", image_fname, " is corrupted")
+		mylib_assert_exception_msg(in_image(entry.data_offset, entry.data_size), "disk image ", image_fname, " is corrupted")
+	}
+
+	this->image_header = header;
+}
+
+// Finds desc.fname in the disk image if one is mounted, or in the host otherwise.
+// Sets the data of the file, and its disk_base for files of the image.
+
+bool Disk::map_file (FileDescriptor& desc)
+{
+	if (this->image_header != nullptr) {
+		const DiskImage::Entry *entry = this->find_image_file(desc.fname);
+
+		if (entry == nullptr)
+			return false;
+
+		desc.data = this->image.get_span().subspan(entry->data_offset, entry->data_size);
+		desc.in_image = true;
+		desc.disk_base = entry->data_offset;
+	}
+	else {
+		if (!desc.file.open(desc.fname))
+			return false;
+
+		desc.data = desc.file.get_span();
+		desc.in_image = false;
+	}
+
+	return true;
+}
+
+const DiskImage::Entry* Disk::find_image_file (const std::string_view name) const
+{
+	const uint32_t hash = DiskImage::hash(name);
+	uint32_t i = this->image_buckets[hash & (this->image_header->nbuckets - 1)];
+
+	// the length of a chain is bounded, in case of a loop in a corrupted image
+	for (uint32_t n = 0; i != DiskImage::no_entry && n < this->image_header->nentries; n++) {
+		const DiskImage::Entry& entry = this->image_entries[i];
+
+		if (entry.hash == hash && std::string_view(this->image_names + entry.name_offset, entry.name_length) == name)
+			return &entry;
+
+		i = entry.next;
+	}
+
+	return nullptr;
+}
+
+Disk::Cost& Disk::Cost::operator+= (const Cost& other)
+{
+	this->controller += other.controller;
+	this->seek += other.seek;
+	this->rotation += other.rotation;
+	this->transfer += other.transfer;
+
+	return *this;
+}
+
+Disk::LatencyProfile Disk::load_latency_profile (const std::string_view fname)
+{
+	std::ifstream file(fname.data());
+
+	if (!file.is_open())
+		mylib_throw_exception_msg("cannot open disk profile ", fname);
+
+	LatencyProfile profile;
+	std::string line;
+	uint32_t line_number = 0;
+
+	const std::pair<std::string_view, uint32_t LatencyProfile::*> fields[] = {
+		{ "controller_cycles", &LatencyProfile::controller_cycles },
+		{ "seek_min_cycles", &LatencyProfile::seek_min_cycles },
+		{ "seek_cycles_per_kb", &LatencyProfile::seek_cycles_per_kb },
+		{ "seek_max_cycles", &LatencyProfile::seek_max_cycles },
+		{ "rotation_cycles", &LatencyProfile::rotation_cycles },
+		{ "cycles_per_word", &LatencyProfile::cycles_per_word },
+		{ "pio_cycles_per_word", &LatencyProfile::pio_cycles_per_word },
+	};
+
+	while (std::getline(file, line)) {
+		line_number++;
+		line = line.substr(0, line.find('#'));
+
+		std::istringstream tokens(line);
+		std::string name, equal, extra;
+		uint32_t value;
+
+		if (!(tokens >> name))
+			continue; // empty line
+
+		if (!(tokens >> equal >> value) || equal != "=" || (tokens >> extra))
+			mylib_throw_exception_msg(fname, ":", line_number, " expected name = value");
+
+		const auto field = std::ranges::find(fields, name, [] (const auto& f) { return f.first; });
+
+		if (field == std::end(fields))
+			mylib_throw_exception_msg(fname, ":", line_number, " unknown parameter ", name);
+
+		profile.*(field->second) = value;
+	}
+
+	return profile;
+}
+
+// Files are saved by name, and opened again by load.
+// The disk image and the latency profile are chosen by the user, they are
+// not saved.
+
+void Disk::save (Snapshot::Writer& out) const
+{
+	const auto save_request = [&out] (const Request& request) {
+		out.put(request.tag);
+		out.put(request.desc->id);
+		out.put(request.pos);
+		out.put(request.paddr);
+		out.put(request.length);
+		out.put(request.disk_addr);
+		out.put(request.cost);
+	};
+
+	const auto save_completion = [&out] (const Completion& completion) {
+		out.put(completion.tag);
+		out.put(completion.status);
+		out.put(completion.words);
+		out.put(completion.cost);
+	};
+
+	out.begin(DeviceId::Disk);
+
+	// in id order, so the same machine always gives the same snapshot
+	std::vector<uint16_t> ids;
+
+	for (const auto& it: this->file_descriptors)
+		ids.push_back(it.first);
+
+	std::ranges::sort(ids);
+
+	out.put<uint32_t>(ids.size());
+
+	for (const uint16_t id: ids) {
+		const FileDescriptor& desc = this->file_descriptors.at(id);
+
+		out.put(desc.id);
+		out.put_string(desc.fname);
+		out.put(desc.in_image);
+		out.put<uint32_t>(desc.data.size());
+		out.put(desc.pos);
+		out.put(desc.disk_base);
+		out.put(desc.pending_requests);
+		out.put_span(std::span<const uint8_t>(desc.write_cache));
+		out.put(desc.write_cache_pos);
+	}
+
+	out.put(this->count);
+	out.put(this->next_id);
+	out.put(this->state);
+	out.put_string(this->fname);
+	out.put(this->data_written);
+	out.put(this->data_result);
+	out.put<uint16_t>((this->current_file_descriptor == nullptr) ? 0 : this->current_file_descriptor->id);
+	out.put(this->error);
+	out.put(this->dma_paddr);
+	out.put(this->dma_length);
+	out.put(this->dma_transfer_words);
+
+	// the transfer is only in use until the state machine is back to Idle
+	const bool transferring = this->state == State::ReadingFile
+		|| this->state == State::UploadingFileSize
+		|| this->state == State::UploadingFile
+		|| this->state == State::ReadingFileDma;
+
+	out.put(transferring);
+
+	if (transferring) {
+		const FileDescriptor& desc = this->file_descriptors.at(this->transfer_id);
+
+		out.put(this->transfer_id);
+		out.put<uint32_t>(this->transfer.data() - desc.data.data());
+		out.put<uint32_t>(this->transfer.size());
+	}
+
+	if (this->state == State::DownloadingFile)
+		out.put(this->write_file_descriptor->id);
+
+	out.put(this->cmd_event);
+	out.put(this->queue_event);
+
+	out.put<uint32_t>(this->queue.size());
+
+	for (const Request& request: this->queue)
+		save_request(request);
+
+	out.put(this->request_active);
+
+	if (this->request_active)
+		save_request(this->active_request);
+
+	out.put(this->request_done_cycle);
+	out.put(this->head_pos);
+	out.put(this->request_pos);
+	out.put(this->last_request_tag);
+	out.put(this->next_request_tag);
+
+	out.put<uint32_t>(this->completions.size());
+
+	for (const Completion& completion: this->completions)
+		save_completion(completion);
+
+	save_completion(this->last_completion);
+	out.put(this->completion_interrupt);
+
+	out.put(this->cmd_cost);
+	out.put(this->total_cost);
+	out.put(this->operations);
+}
+
+// The files open before are flushed and closed.
+// Raises Mylib::Exception if a file of the snapshot cannot be opened, or
+// became smaller than it was.
+
+void Disk::load (Snapshot::Reader& in)
+{
+	in.begin(DeviceId::Disk);
+
+	this->wait_host_reads();
+
+	for (auto& it: this->file_descriptors)
+		this->flush_file(it.second);
+
+	this->file_descriptors.clear();
+	this->open_fnames.clear();
+	this->queue.clear();
+	this->completions.clear();
+	this->host_read = std::future<void>();
+
+	const auto find_desc = [this] (const uint16_t id) -> FileDescriptor& {
+		const auto it = this->file_descriptors.find(id);
+
+		mylib_assert_exception_msg(it != this->file_descriptors.end(), "snapshot has an invalid disk file descriptor ", id)
+
+		return it->second;
+	};
+
+	const auto load_request = [&in, &find_desc] (Request& request) {
+		in.get(request.tag);
+		request.desc = &find_desc(in.get<uint16_t>());
+		in.get(request.pos);
+		in.get(request.paddr);
+		in.get(request.length);
+		in.get(request.disk_addr);
+		in.get(request.cost);
+		request.host_read = std::future<void>();
+	};
+
+	const auto load_completion = [&in] (Completion& completion) {
+		in.get(completion.tag);
+		in.get(completion.status);
+		in.get(completion.words);
+		in.get(completion.cost);
+	};
+
+	const uint32_t ndescriptors = in.get<uint32_t>();
+
+	for (uint32_t i = 0; i < ndescriptors; i++) {
+		FileDescriptor desc;
+
+		in.get(desc.id);
+		desc.fname = in.get_string();
+
+		const bool in_image = in.get<bool>();
+		const uint32_t size = in.get<uint32_t>();
+
+		if (!this->map_file(desc) || desc.in_image != in_image || desc.data.size() < size)
+			mylib_throw_exception_msg("cannot open disk file ", desc.fname, " as it was when the snapshot was saved");
+
+		in.get(desc.pos);
+		in.get(desc.disk_base);
+		in.get(desc.pending_requests);
+		desc.write_cache = in.get_vector<uint8_t>();
+		in.get(desc.write_cache_pos);
+
+		this->open_fnames.insert(desc.fname);
+		this->file_descriptors.insert(std::make_pair(desc.id, std::move(desc)));
+	}
+
+	in.get(this->count);
+	in.get(this->next_id);
+	in.get(this->state);
+	this->fname = in.get_string();
+	in.get(this->data_written);
+	in.get(this->data_result);
+
+	const uint16_t current_id = in.get<uint16_t>();
+	this->current_file_descriptor = (current_id == 0) ? nullptr : &find_desc(current_id);
+
+	in.get(this->error);
+	in.get(this->dma_paddr);
+	in.get(this->dma_length);
+	in.get(this->dma_transfer_words);
+
+	if (in.get<bool>()) {
+		in.get(this->transfer_id);
+
+		const FileDescriptor& desc = find_desc(this->transfer_id);
+		const uint32_t offset = in.get<uint32_t>();
+		const uint32_t size = in.get<uint32_t>();
+
+		mylib_assert_exception_msg((static_cast<uint64_t>(offset) + size) <= desc.data.size(), "snapshot has an invalid disk transfer")
+
+		this->transfer = desc.data.subspan(offset, size);
+	}
+	else
+		this->transfer = std::span<const uint8_t>();
+
+	this->write_file_descriptor = (this->state == State::DownloadingFile) ? &find_desc(in.get<uint16_t>()) : nullptr;
+
+	in.get(this->cmd_event);
+	in.get(this->queue_event);
+
+	this->queue.resize(in.get<uint32_t>());
+
+	for (Request& request: this->queue)
+		load_request(request);
+
+	in.get(this->request_active);
+
+	if (this->request_active)
+		load_request(this->active_request);
+
+	in.get(this->request_done_cycle);
+	in.get(this->head_pos);
+	in.get(this->request_pos);
+	in.get(this->last_request_tag);
+	in.get(this->next_request_tag);
+
+	this->completions.resize(in.get<uint32_t>());
+
+	for (Completion& completion: this->completions)
+		load_completion(completion);
+
+	load_completion(this->last_completion);
+	in.get(this->completion_interrupt);
 
-	return size;
+	in.get(this->cmd_cost);
+	in.get(this->total_cost);
+	in.get(this->operations);
 }
 
 // ---------------------------------------
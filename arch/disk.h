@@ -1,15 +1,22 @@
 #ifndef __ARQSIM_HEADER_ARCH_DISK_H__
 #define __ARQSIM_HEADER_ARCH_DISK_H__
 
-#include <fstream>
 #include <unordered_map>
+#include <unordered_set>
+#include <string>
+#include <span>
+#include <future>
 #include <vector>
+#include <deque>
 
 #include <my-lib/std.h>
 #include <my-lib/macros.h>
 
 #include "../config.h"
 #include "device.h"
+#include "disk-image.h"
+#include "snapshot.h"
+#include "../lib.h"
 
 namespace Arch {
 
@@ -26,6 +33,9 @@ public:
 		WriteFile          = 4,
 		GetFileSize        = 5,
 		SeekFilePos        = 6,
+		ReadFileDma        = 7,
+		FlushFile          = 8,
+		QueueReadDma       = 9,
 	};
 
 	enum class State : uint16_t {
@@ -34,6 +44,9 @@ public:
 		ReadingFile             = 2,
 		UploadingFileSize       = 3,
 		UploadingFile           = 4,
+		ReadingFileDma          = 5,
+		DownloadingFile         = 6,
+		WritingFile             = 7,
 	};
 
 	enum class Error : uint16_t {
@@ -41,41 +54,210 @@ public:
 		CannotOpenFile          = 1,
 		FileAlreadyOpen         = 2,
 		InvalidFileDescriptor   = 3,
+		InvalidDmaRange         = 4,
+		InvalidFilePos          = 5,
+		CannotWriteFile         = 6,
+		QueueFull               = 7,
+		FileBusy                = 8,
+	};
+
+	struct Settings {
+		std::string image_fname; // if set, files are opened from this disk image instead of the host
+		std::string profile_fname; // latency profile, see LatencyProfile
+	};
+
+	// Cost of each operation, in cycles:
+	//   controller_cycles
+	//   + seek: seek_min_cycles + seek_cycles_per_kb for each KB between the head and the data,
+	//     limited to seek_max_cycles (0 is no limit), nothing if the head is already there
+	//   + rotation: half of rotation_cycles, after every seek
+	//   + transfer: cycles_per_word for each word of a DMA read, or
+	//     pio_cycles_per_word for each word of ReadFile and WriteFile,
+	//     whose bytes the cpu already moves one by one through DiskData
+	// A profile file has a "name = value" line for each field it changes, # starts a comment.
+	struct LatencyProfile {
+		uint32_t controller_cycles = Config::disk_interrupt_cycles;
+		uint32_t seek_min_cycles = 0;
+		uint32_t seek_cycles_per_kb = 0;
+		uint32_t seek_max_cycles = Config::disk_seek_max_cycles;
+		uint32_t rotation_cycles = 0;
+		uint32_t cycles_per_word = Config::disk_dma_cycles_per_word;
+		uint32_t pio_cycles_per_word = 0;
+	};
+
+	struct Cost {
+		uint64_t controller = 0;
+		uint64_t seek = 0;
+		uint64_t rotation = 0;
+		uint64_t transfer = 0;
+
+		uint64_t total () const
+		{
+			return this->controller + this->seek + this->rotation + this->transfer;
+		}
+
+		Cost& operator+= (const Cost& other);
 	};
 
 private:
 	struct FileDescriptor {
 		uint16_t id;
 		std::string fname;
-		std::fstream file;
+		Lib::MappedFile file; // host files only
+		std::span<const uint8_t> data; // the whole file, from its mapping or from the disk image
+		bool in_image;
+		uint32_t pos = 0; // in bytes, next byte to be read or written
+
+		// where the file starts in the modelled disk, to sort the queued requests
+		uint64_t disk_base;
+
+		// queued requests of this file, it can't be written or closed until they complete
+		uint32_t pending_requests = 0;
+
+		// Write-back cache, bytes written by the guest starting at write_cache_pos.
+		// The mapping doesn't see them until they are flushed to the host file.
+		std::vector<uint8_t> write_cache;
+		uint32_t write_cache_pos = 0;
+	};
+
+	struct Request {
+		uint16_t tag;
+		FileDescriptor *desc;
+		uint32_t pos; // in bytes
+		uint16_t paddr;
+		uint16_t length; // in words
+		uint64_t disk_addr; // disk_base + pos
+		uint64_t cost; // cycles, charged when it starts
+		std::future<void> host_read;
+	};
+
+	struct Completion {
+		uint16_t tag = 0;
+		Error status = Error::NoError;
+		uint16_t words = 0;
+		uint64_t cost = 0;
 	};
 
 private:
 	std::unordered_map<uint16_t, FileDescriptor> file_descriptors;
-	uint32_t count = 0; // used for read/write operations, to count the amount of cycles AND to know how many bytes were uploaded
+	std::unordered_set<std::string> open_fnames;
+	uint32_t count = 0; // used for read and write operations, to know how many bytes were transferred
 	uint16_t next_id = 100;
 	State state = State::Idle;
 	std::string fname;
 	uint16_t data_written;
 	uint16_t data_result;
-	std::vector<uint8_t> buffer;
 	FileDescriptor *current_file_descriptor = nullptr;
 	Error error = Error::NoError;
 
+	// DMA reads copy dma_length words from the file to physical memory at dma_paddr
+	uint16_t dma_paddr = 0;
+	uint16_t dma_length = 0;
+	uint16_t dma_transfer_words; // dma_length, limited to the end of the file
+
+	// Bytes of the current ReadFile or ReadFileDma, straight from the file mapping.
+	std::span<const uint8_t> transfer;
+	uint16_t transfer_id; // file descriptor of transfer
+
+	// File of the current WriteFile, the bytes that follow go to it
+	// even if DiskFileID changes before they arrive.
+	FileDescriptor *write_file_descriptor = nullptr;
+
+	// Touches the pages of transfer in host_io while the simulated latency
+	// elapses, so a cold file is brought from the host disk in the background.
+	// The simulation only waits for it if it is still running when the
+	// latency is over.
+	std::future<void> host_read;
+
+	// The state machine above runs a single command at a time, while the
+	// request queue below runs in parallel to it. Each has its own event.
+	uint64_t cmd_event = no_event;
+	uint64_t queue_event = no_event;
+
+	// Requests posted with QueueReadDma wait in queue, and are served one at
+	// a time in C-LOOK order: the head moves towards higher disk addresses,
+	// and jumps back to the lowest one when there is nothing ahead of it.
+	std::vector<Request> queue;
+	Request active_request;
+	bool request_active = false;
+	uint64_t request_done_cycle;
+	uint64_t head_pos = 0; // moved by every operation, queued or not
+	uint16_t request_pos = 0;
+	uint16_t last_request_tag = 0;
+	uint16_t next_request_tag = 1; // 0 means no request
+
+	// completed requests, popped by the OS through DiskCompletedTag
+	std::deque<Completion> completions;
+	Completion last_completion;
+	bool completion_interrupt = false; // raised after a request completes, until accepted
+
+	LatencyProfile latency;
+	uint64_t cmd_cost = 0; // of the last command, read through DiskCmdCost
+
+	// every operation so far, for the statistics printed at exit
+	Cost total_cost;
+	uint64_t operations = 0;
+
+	// mounted disk image, mapped once, files of the image are slices of it
+	Lib::MappedFile image;
+	const DiskImage::Header *image_header = nullptr;
+	const uint32_t *image_buckets;
+	const DiskImage::Entry *image_entries;
+	const char *image_names;
+
+	// declared last, so its threads are done before the other members are destroyed
+	Lib::HostWorker host_io;
+
 public:
-	Disk (Computer& computer);
+	Disk (Computer& computer, const Settings& settings);
 	~Disk ();
 
-	void run_cycle () override final;
+	void run_cycle ();
+
+	const Cost& get_total_cost () const
+	{
+		return this->total_cost;
+	}
+
+	uint64_t get_operations () const
+	{
+		return this->operations;
+	}
+
+	static LatencyProfile load_latency_profile (const std::string_view fname);
+
+	void save (Snapshot::Writer& out) const;
+	void load (Snapshot::Reader& in);
+
 	uint16_t read (const uint16_t port) override final;
 	void write (const uint16_t port, const uint16_t value) override final;
 
 private:
+	void mount_image (const std::string_view image_fname);
+	const DiskImage::Entry* find_image_file (const std::string_view name) const;
+	bool map_file (FileDescriptor& desc);
+	void wait_host_reads ();
 	void process_cmd (const uint16_t cmd_);
+	void run_cmd_event ();
+	void run_queue_event ();
+	void start_cmd (const uint64_t cycles);
+	uint64_t charge (const uint64_t disk_addr, const uint32_t size_bytes, const uint32_t cycles_per_word);
+	void schedule_next_event ();
+	void queue_request ();
+	void start_next_request ();
+	void complete_request ();
 	uint16_t process_data_read ();
 	void process_data_write (const uint16_t value);
+	void write_byte (FileDescriptor& desc, const uint8_t value);
+	bool flush_file (FileDescriptor& desc);
+	uint64_t start_transfer (const uint32_t size_bytes, const uint32_t cycles_per_word);
+	void finish_host_read ();
+	std::future<void> prefetch (const std::span<const uint8_t> data);
+	void dma_transfer ();
+	void copy_to_memory (const std::span<const uint8_t> data, const uint16_t paddr, const uint16_t words);
 
-	static std::fstream::pos_type get_file_size (std::fstream& file);
+	static uint32_t get_file_size (const FileDescriptor& desc);
+	static bool can_write_file (const FileDescriptor& desc);
 };
 
 // ---------------------------------------
@@ -1,3 +1,6 @@
+#include <vector>
+#include <algorithm>
+
 #include "memory.h"
 #include "terminal.h"
 
@@ -8,7 +11,7 @@ namespace Arch {
 // ---------------------------------------
 
 Memory::Memory (Computer& computer)
-	: Device(computer)
+	: Device(computer, DeviceId::Memory)
 {
 	for (auto& v: this->data)
 		v = 0;
@@ -19,10 +22,6 @@ Memory::~Memory ()
 	
 }
 
-void Memory::run_cycle ()
-{	
-}
-
 void Memory::dump (const uint16_t init, const uint16_t end) const
 {
 	dprintln("memory dump from paddr ", init, " to ", end);
@@ -31,6 +30,69 @@ void Memory::dump (const uint16_t init, const uint16_t end) const
 	dprintln();
 }
 
+void Memory::mark_dirty (const uint16_t paddr, const uint32_t length)
+{
+	if (length == 0)
+		return;
+
+	const uint32_t first = paddr >> Config::page_size_bits;
+	const uint32_t last = std::min<uint32_t>((paddr + length - 1) >> Config::page_size_bits, npages - 1);
+
+	for (uint32_t page = first; page <= last; page++)
+		this->dirty_pages[page] = true;
+}
+
+void Memory::save (Snapshot::Writer& out) const
+{
+	out.begin(DeviceId::Memory);
+	out.put(false);
+	out.put_span(std::span<const uint16_t>(this->data));
+}
+
+// The indexes of the dirty pages, then their words.
+
+void Memory::save_delta (Snapshot::Writer& out) const
+{
+	std::vector<uint16_t> pages;
+	std::vector<uint16_t> words;
+
+	for (uint32_t page = 0; page < npages; page++) {
+		if (!this->dirty_pages[page])
+			continue;
+
+		const auto first = this->data.begin() + page * Config::page_size;
+
+		pages.push_back(page);
+		words.insert(words.end(), first, first + Config::page_size);
+	}
+
+	out.begin(DeviceId::Memory);
+	out.put(true);
+	out.put_span(std::span<const uint16_t>(pages));
+	out.put_span(std::span<const uint16_t>(words));
+}
+
+void Memory::load (Snapshot::Reader& in)
+{
+	in.begin(DeviceId::Memory);
+
+	if (!in.get<bool>()) {
+		in.get_span(std::span(this->data));
+		return;
+	}
+
+	const std::vector<uint16_t> pages = in.get_vector<uint16_t>();
+	const std::vector<uint16_t> words = in.get_vector<uint16_t>();
+
+	mylib_assert_exception_msg(words.size() == (pages.size() * Config::page_size), "snapshot has corrupted memory pages")
+
+	for (uint32_t i = 0; i < pages.size(); i++) {
+		mylib_assert_exception_msg(pages[i] < npages, "snapshot has an invalid memory page ", pages[i])
+
+		std::copy_n(words.begin() + i * Config::page_size, Config::page_size, this->data.begin() + pages[i] * Config::page_size);
+	}
+}
+
 // ---------------------------------------
 
 } // end namespace
\ No newline at end of file
@@ -2,12 +2,14 @@
 #define __ARQSIM_HEADER_ARCH_MEMORY_H__
 
 #include <array>
+#include <bitset>
 
 #include <my-lib/std.h>
 #include <my-lib/macros.h>
 
 #include "../config.h"
 #include "device.h"
+#include "snapshot.h"
 
 namespace Arch {
 
@@ -15,15 +17,19 @@ namespace Arch {
 
 class Memory : public Device
 {
+public:
+	static constexpr uint32_t npages = Config::phys_mem_size_words / Config::page_size;
+
 private:
 	std::array<uint16_t, Config::phys_mem_size_words> data;
 
+	// pages written since the last checkpoint, see Computer::save_checkpoint
+	std::bitset<npages> dirty_pages;
+
 public:
 	Memory (Computer& computer);
 	~Memory ();
 
-	void run_cycle () override final;
-
 	inline uint16_t* get_raw ()
 	{
 		return this->data.data();
@@ -41,7 +47,27 @@ public:
 		return this->data[paddr];
 	}
 
+	inline void mark_dirty (const uint16_t paddr)
+	{
+		this->dirty_pages[paddr >> Config::page_size_bits] = true;
+	}
+
+	void mark_dirty (const uint16_t paddr, const uint32_t length);
+
+	inline void clear_dirty ()
+	{
+		this->dirty_pages.reset();
+	}
+
 	void dump (const uint16_t init = 0, const uint16_t end = Config::phys_mem_size_words-1) const;
+
+	// every page
+	void save (Snapshot::Writer& out) const;
+
+	// only the dirty pages, applied by load over the memory they were saved from
+	void save_delta (Snapshot::Writer& out) const;
+
+	void load (Snapshot::Reader& in);
 };
 
 // ---------------------------------------
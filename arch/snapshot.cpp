@@ -0,0 +1,95 @@
+#include <fstream>
+#include <algorithm>
+
+#include "snapshot.h"
+
+// ---------------------------------------
+
+namespace Arch {
+namespace Snapshot {
+
+// ---------------------------------------
+
+static Header this_machine (const uint32_t sequence, const uint32_t id, const uint32_t parent)
+{
+	Header header;
+
+	std::memcpy(header.magic, magic, sizeof(header.magic));
+	header.version = version;
+	header.phys_mem_size_words = Config::phys_mem_size_words;
+	header.page_size = Config::page_size;
+	header.nregs = Config::nregs;
+	header.sequence = sequence;
+	header.id = id;
+	header.parent = parent;
+
+	return header;
+}
+
+// ---------------------------------------
+
+Writer::Writer (const uint32_t sequence, const uint32_t id, const uint32_t parent)
+{
+	this->put(this_machine(sequence, id, parent));
+}
+
+// the whole snapshot is built in memory, and written at once
+
+void Writer::save (const std::string_view fname) const
+{
+	std::ofstream file(std::string(fname), std::ios::binary | std::ios::out | std::ios::trunc);
+
+	if (!file.is_open())
+		mylib_throw_exception_msg("cannot create snapshot ", fname);
+
+	file.write(reinterpret_cast<const char*>(this->buffer.data()), this->buffer.size());
+
+	if (!file.good())
+		mylib_throw_exception_msg("cannot write snapshot ", fname);
+}
+
+// ---------------------------------------
+
+Reader::Reader (const std::string_view fname)
+	: fname(fname), pos(0)
+{
+	if (!this->file.open(fname))
+		mylib_throw_exception_msg("cannot open snapshot ", fname);
+
+	const Header expected = this_machine(0, 0, 0);
+
+	this->header = this->get<Header>();
+
+	mylib_assert_exception_msg(std::ranges::equal(this->header.magic, expected.magic), fname, " is not a snapshot")
+	mylib_assert_exception_msg(this->header.version == expected.version, "snapshot ", fname, " has unsupported version ", this->header.version)
+	mylib_assert_exception_msg(this->header.phys_mem_size_words == expected.phys_mem_size_words
+		&& this->header.page_size == expected.page_size
+		&& this->header.nregs == expected.nregs, "snapshot ", fname, " was saved by a machine with a different configuration")
+}
+
+void Reader::begin (const DeviceId device_id)
+{
+	const DeviceId saved = this->get<DeviceId>();
+
+	mylib_assert_exception_msg(saved == device_id, "snapshot ", this->fname, " is corrupted, expected device ", std::to_underlying(device_id), " found ", std::to_underlying(saved))
+}
+
+void Reader::end ()
+{
+	mylib_assert_exception_msg(this->pos == this->file.get_size(), "snapshot ", this->fname, " has trailing data")
+}
+
+const uint8_t* Reader::consume (const uint64_t size)
+{
+	mylib_assert_exception_msg((this->pos + size) <= this->file.get_size(), "snapshot ", this->fname, " is truncated")
+
+	const uint8_t *data = this->file.get_data() + this->pos;
+	this->pos += size;
+
+	return data;
+}
+
+// ---------------------------------------
+
+} // end namespace
+} // end namespace
@@ -0,0 +1,191 @@
+#ifndef __ARQSIM_HEADER_ARCH_SNAPSHOT_H__
+#define __ARQSIM_HEADER_ARCH_SNAPSHOT_H__
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <span>
+#include <type_traits>
+
+#include <cstdint>
+#include <cstring>
+
+#include <my-lib/std.h>
+#include <my-lib/macros.h>
+
+#include "../config.h"
+#include "device.h"
+#include "../lib.h"
+
+// Layout of a snapshot file, the whole state of the machine.
+// Saved by Computer::save_snapshot and restored by Computer::load_snapshot.
+// Checkpoints are snapshots too, see Computer::save_checkpoint.
+// Everything is in the host byte order, with no padding between values.
+//
+// Header
+// Memory section, first so the checkpoints of a chain can be replayed
+//   reading only their memory
+// A section for each other device, in DeviceId order, then one for the Computer.
+// Each section starts with its DeviceId, the Computer uses DeviceId::Count.
+
+namespace Arch {
+namespace Snapshot {
+
+// ---------------------------------------
+
+inline constexpr char magic[8] = { 'A', 'R', 'Q', 'S', 'N', 'A', 'P', 0 };
+
+// must be incremented whenever a device changes what it saves
+inline constexpr uint32_t version = 4;
+
+// a snapshot can only be restored in a machine with the same configuration
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t phys_mem_size_words;
+	uint32_t page_size;
+	uint32_t nregs;
+
+	// position in a chain of checkpoints, 0 for a full snapshot
+	uint32_t sequence;
+
+	// Random, identifies a checkpoint. Each one stores the id of the one before
+	// it, so a chain replays only the checkpoints saved one after the other,
+	// not the ones left from a run that was rolled back. 0 if not in a chain.
+	uint32_t id;
+	uint32_t parent;
+};
+
+// ---------------------------------------
+
+class Writer
+{
+private:
+	std::vector<uint8_t> buffer;
+
+public:
+	Writer (const uint32_t sequence = 0, const uint32_t id = 0, const uint32_t parent = 0);
+
+	template <typename T>
+	void put (const T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+
+		const auto *bytes = reinterpret_cast<const uint8_t*>(&value);
+		this->buffer.insert(this->buffer.end(), bytes, bytes + sizeof(T));
+	}
+
+	// the amount of elements goes first
+	template <typename T>
+	void put_span (const std::span<const T> values)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+
+		this->put<uint32_t>(values.size());
+
+		const auto *bytes = reinterpret_cast<const uint8_t*>(values.data());
+		this->buffer.insert(this->buffer.end(), bytes, bytes + values.size_bytes());
+	}
+
+	void put_string (const std::string_view str)
+	{
+		this->put_span(std::span(str.data(), str.size()));
+	}
+
+	void begin (const DeviceId device_id)
+	{
+		this->put(device_id);
+	}
+
+	// raises Mylib::Exception if the file cannot be written
+	void save (const std::string_view fname) const;
+};
+
+// ---------------------------------------
+
+// Reads straight from a mapping of the file.
+// Raises Mylib::Exception if the file is not a snapshot of this machine,
+// or if it ends before what is read.
+
+class Reader
+{
+private:
+	Lib::MappedFile file;
+	std::string fname;
+	Header header;
+	uint32_t pos;
+
+public:
+	Reader (const std::string_view fname);
+
+	const Header& get_header () const
+	{
+		return this->header;
+	}
+
+	template <typename T>
+	T get ()
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+
+		T value;
+		std::memcpy(&value, this->consume(sizeof(T)), sizeof(T));
+
+		return value;
+	}
+
+	template <typename T>
+	void get (T& value)
+	{
+		value = this->get<T>();
+	}
+
+	// the amount of elements must be the size of dest
+	template <typename T, std::size_t extent>
+	void get_span (const std::span<T, extent> dest)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+
+		const uint32_t n = this->get<uint32_t>();
+
+		mylib_assert_exception_msg(n == dest.size(), "snapshot ", this->fname, " doesn't match this machine")
+
+		if (n > 0)
+			std::memcpy(dest.data(), this->consume(dest.size_bytes()), dest.size_bytes());
+	}
+
+	template <typename T>
+	std::vector<T> get_vector ()
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+
+		const uint32_t n = this->get<uint32_t>();
+		std::vector<T> values(n);
+
+		if (n > 0)
+			std::memcpy(values.data(), this->consume(static_cast<uint64_t>(n) * sizeof(T)), n * sizeof(T));
+
+		return values;
+	}
+
+	std::string get_string ()
+	{
+		const std::vector<char> chars = this->get_vector<char>();
+		return std::string(chars.begin(), chars.end());
+	}
+
+	void begin (const DeviceId device_id);
+
+	// every byte of the file must have been read
+	void end ();
+
+private:
+	const uint8_t* consume (const uint64_t size);
+};
+
+// ---------------------------------------
+
+} // end namespace
+} // end namespace
+
+#endif
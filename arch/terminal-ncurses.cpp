@@ -0,0 +1,113 @@
+#if defined(CONFIG_TARGET_LINUX)
+	#include <ncurses.h>
+#elif defined(CONFIG_TARGET_WINDOWS)
+	#include <ncurses/ncurses.h>
+#else
+	#error Untested platform
+#endif
+
+#include "terminal-ncurses.h"
+
+// ---------------------------------------
+
+namespace Arch {
+namespace Ncurses {
+
+// ---------------------------------------
+
+class WindowVideoOutput : public VideoOutput
+{
+private:
+	WINDOW *win;
+
+public:
+	WindowVideoOutput (const uint32_t xinit, const uint32_t xend, const uint32_t yinit, const uint32_t yend);
+
+	// Copies the dirty rows to the window.
+	// The screen is only updated by the next update_screen().
+	void flush () override final;
+};
+
+// ---------------------------------------
+
+// the border takes one row or column in each side
+
+WindowVideoOutput::WindowVideoOutput (const uint32_t xinit, const uint32_t xend, const uint32_t yinit, const uint32_t yend)
+	: VideoOutput(yend - yinit - 2, xend - xinit - 2)
+{
+	this->win = newwin(yend - yinit, xend - xinit, yinit, xinit);
+	refresh();
+	box(this->win, 0, 0);
+	wrefresh(this->win);
+
+	this->flush();
+	doupdate();
+}
+
+void WindowVideoOutput::flush ()
+{
+	if (!this->dirty)
+		return;
+
+	const auto ncols = this->buffer.get_ncols();
+
+	for (uint32_t row = 0; row < this->nrows; row++) {
+		if (!this->dirty_rows[row])
+			continue;
+
+		for (uint32_t col = 0; col < ncols; col++)
+			mvwaddch(this->win, row+1, col+1, static_cast<unsigned char>(this->cell(row, col)));
+
+		this->dirty_rows[row] = false;
+	}
+
+	this->dirty = false;
+
+	wnoutrefresh(this->win);
+}
+
+// ---------------------------------------
+
+void init_screen ()
+{
+	initscr();
+	timeout(0); // non-blocking input
+	noecho(); // don't print input
+}
+
+void end_screen ()
+{
+	endwin();
+}
+
+void update_screen ()
+{
+	doupdate();
+}
+
+std::vector<std::unique_ptr<VideoOutput>> create_videos ()
+{
+	std::vector<std::unique_ptr<VideoOutput>> videos;
+
+	const uint32_t total_w = COLS;
+	const uint32_t total_h = LINES;
+
+	// arch video
+	videos.push_back( std::make_unique<WindowVideoOutput>(1, total_w/3, 1, total_h) );
+
+	// kernel video
+	videos.push_back( std::make_unique<WindowVideoOutput>(total_w/3 + 1, 2*(total_w/3), 1, total_h/2) );
+
+	// command video
+	videos.push_back( std::make_unique<WindowVideoOutput>(total_w/3 + 1, 2*(total_w/3), total_h/2 + 1, total_h) );
+
+	// app video
+	videos.push_back( std::make_unique<WindowVideoOutput>(2*(total_w/3) + 1, total_w, 1, total_h) );
+
+	return videos;
+}
+
+// ---------------------------------------
+
+} // end namespace
+} // end namespace
@@ -0,0 +1,31 @@
+#ifndef __ARQSIM_HEADER_ARCH_TERMINAL_NCURSES_H__
+#define __ARQSIM_HEADER_ARCH_TERMINAL_NCURSES_H__
+
+#include <vector>
+#include <memory>
+
+#include "terminal.h"
+
+// The ncurses screen, the only part of the simulator that depends on ncurses.
+// Not built with CONFIG_HEADLESS_ONLY, see the Makefile.
+
+namespace Arch {
+namespace Ncurses {
+
+// ---------------------------------------
+
+void init_screen ();
+void end_screen ();
+
+// draws what the windows flushed since the last update
+void update_screen ();
+
+// one window per sub-terminal, in the order of Terminal::Type
+std::vector<std::unique_ptr<VideoOutput>> create_videos ();
+
+// ---------------------------------------
+
+} // end namespace
+} // end namespace
+
+#endif
@@ -1,6 +1,23 @@
+#include <chrono>
+#include <algorithm>
+
+#if defined(CONFIG_TARGET_LINUX)
+	#include <poll.h>
+	#include <unistd.h>
+	#include <fcntl.h>
+#elif defined(CONFIG_TARGET_WINDOWS)
+	#include <conio.h>
+	#include <io.h>
+	#include <fcntl.h>
+#endif
+
 #include "terminal.h"
 #include "computer.h"
 #include "cpu.h"
+
+#if !defined(CONFIG_HEADLESS_ONLY)
+	#include "terminal-ncurses.h"
+#endif
  
 // ---------------------------------------
 
@@ -8,34 +25,148 @@ namespace Arch {
 
 // ---------------------------------------
 
-VideoOutput::VideoOutput (const uint32_t xinit, const uint32_t xend, const uint32_t yinit, const uint32_t yend)
+// Reads the keyboard in a host thread, so the simulation never makes a
+// system call to poll it, nor has to check for keys every few cycles.
+// The thread wakes the terminal up when keys arrive, and whenever the
+// screen is due to be redrawn.
+// The stop request is checked at least every input_wait.
+
+static constexpr auto input_wait = std::chrono::milliseconds(20);
+
+static constexpr auto frame_interval = std::chrono::steady_clock::duration(std::chrono::seconds(1)) / Config::terminal_fps;
+
+static void push_host_key (std::stop_token& stop, Computer& computer, Terminal::HostInputQueue& queue, const uint8_t key)
 {
-	const uint32_t w = xend - xinit;
-	const uint32_t h = yend - yinit;
+	// wait for the simulation to catch up, typed keys are never dropped
+	while (!queue.push(key)) {
+		if (stop.stop_requested())
+			return;
+		computer.post_terminal_event();
+		std::this_thread::sleep_for(input_wait);
+	}
+}
 
-	this->buffer = MatrixBuffer(h - 2, w - 2);
-	this->buffer.set_all(' ');
+// In headless mode, fd may be a file or a pipe.
+// When there is no more input, the thread only wakes the terminal up to
+// redraw the screen.
 
-	this->x = 0;
-	this->y = 0;
+static void input_thread_main (std::stop_token stop, Computer& computer, Terminal::HostInputQueue& queue, const int fd, const bool headless)
+{
+	auto next_frame = std::chrono::steady_clock::now();
+	bool input_ended = false;
+
+	while (!stop.stop_requested()) {
+		const auto now = std::chrono::steady_clock::now();
+
+		if (now >= next_frame) {
+			computer.post_terminal_event();
+			next_frame = now + frame_interval;
+		}
+
+		if (input_ended) {
+			std::this_thread::sleep_for(input_wait);
+			continue;
+		}
+
+	#if defined(CONFIG_TARGET_LINUX)
+		pollfd pfd = {
+			.fd = fd,
+			.events = POLLIN,
+			.revents = 0
+			};
+
+		if (poll(&pfd, 1, input_wait.count()) <= 0)
+			continue;
 
-	this->win = newwin(h, w, yinit, xinit);
-	refresh();
-	box(this->win, 0, 0);
-	wrefresh(this->win);
+		uint8_t keys[64];
+		const ssize_t n = ::read(fd, keys, sizeof(keys));
 
-	this->update();
+		if (n <= 0) {
+			input_ended = true;
+			continue;
+		}
+
+		for (ssize_t i = 0; i < n; i++)
+			push_host_key(stop, computer, queue, keys[i]);
+	#elif defined(CONFIG_TARGET_WINDOWS)
+		if (headless) {
+			// Blocking, a pipe must be closed by the writer before we exit.
+			// The screen is not redrawn while it waits, only the output files.
+			uint8_t keys[64];
+			const int n = _read(fd, keys, sizeof(keys));
+
+			if (n <= 0) {
+				input_ended = true;
+				continue;
+			}
+
+			for (int i = 0; i < n; i++)
+				push_host_key(stop, computer, queue, keys[i]);
+		}
+		else if (_kbhit())
+			push_host_key(stop, computer, queue, static_cast<uint8_t>(_getch()));
+		else {
+			std::this_thread::sleep_for(input_wait);
+			continue;
+		}
+	#endif
+
+		computer.post_terminal_event();
+	}
 }
 
-VideoOutput::~VideoOutput ()
+static int open_input (const std::string& fname)
 {
+	if (fname.empty())
+		return 0; // stdin
 
+#if defined(CONFIG_TARGET_LINUX)
+	const int fd = ::open(fname.c_str(), O_RDONLY);
+#elif defined(CONFIG_TARGET_WINDOWS)
+	const int fd = _open(fname.c_str(), _O_RDONLY | _O_BINARY);
+#endif
+
+	if (fd < 0)
+		mylib_throw_exception_msg("cannot open keyboard input ", fname);
+
+	return fd;
+}
+
+static void close_input (const int fd)
+{
+	if (fd == 0)
+		return;
+
+#if defined(CONFIG_TARGET_LINUX)
+	::close(fd);
+#elif defined(CONFIG_TARGET_WINDOWS)
+	_close(fd);
+#endif
+}
+
+// ---------------------------------------
+
+VideoOutput::VideoOutput (const uint32_t nrows, const uint32_t ncols)
+{
+	this->nrows = nrows;
+	this->top = 0;
+	this->history = 0;
+
+	this->buffer = MatrixBuffer(this->nrows + Config::terminal_scrollback_lines, ncols);
+	this->buffer.set_all(' ');
+
+	this->x = 0;
+	this->y = 0;
+
+	this->dirty_rows.resize(this->nrows);
+
+	for (uint32_t row = 0; row < this->nrows; row++)
+		this->mark_dirty(row);
 }
 
 void VideoOutput::print (const std::string_view str)
 {
 	const auto len = str.size();
-	const auto nrows = this->buffer.get_nrows();
 	const auto ncols = this->buffer.get_ncols();
 
 	for (uint32_t i = 0; i < len; i++) {
@@ -43,7 +174,7 @@ void VideoOutput::print (const std::string_view str)
 			this->x = 0;
 			this->y++;
 
-			if (this->y >= nrows) {
+			if (this->y >= this->nrows) {
 				this->roll();
 				this->y--;
 			}
@@ -52,12 +183,14 @@ void VideoOutput::print (const std::string_view str)
 		if (str[i] == '\n') {
 			// fill the rest of the line with spaces
 			for (uint32_t i = this->x; i < ncols; i++)
-				this->buffer[this->y, i] = ' ';
+				this->cell(this->y, i) = ' ';
+
+			this->mark_dirty(this->y);
 			
 			this->x = 0;
 			this->y++;
 
-			if (this->y >= nrows) {
+			if (this->y >= this->nrows) {
 				this->roll();
 				this->y--;
 			}
@@ -66,104 +199,290 @@ void VideoOutput::print (const std::string_view str)
 			this->x = 0;
 
 			for (uint32_t i = 0; i < ncols; i++)
-				this->buffer[this->y, i] = ' ';
+				this->cell(this->y, i) = ' ';
+
+			this->mark_dirty(this->y);
 		}
 		else {
-			this->buffer[this->y, this->x] = str[i];
+			this->cell(this->y, this->x) = str[i];
+			this->mark_dirty(this->y);
 			this->x++;
 		}
 	}
-
-	this->update();
 }
 
+// The first visible row becomes history.
+// When the history is full, its oldest row is reused as the new last row.
+
 void VideoOutput::roll ()
 {
-	const auto nrows = this->buffer.get_nrows();
 	const auto ncols = this->buffer.get_ncols();
 
-	for (uint32_t row = 1; row < nrows; row++) {
-		for (uint32_t col = 0; col < ncols; col++)
-			this->buffer[row-1, col] = this->buffer[row, col];
-	}
+	this->top = (this->top + 1) % this->buffer.get_nrows();
+
+	if (this->history < Config::terminal_scrollback_lines)
+		this->history++;
 
 	// clear last line
 	for (uint32_t col = 0; col < ncols; col++)
-		this->buffer[nrows-1, col] = ' ';
+		this->cell(this->nrows-1, col) = ' ';
+
+	// every visible row moved
+	for (uint32_t row = 0; row < this->nrows; row++)
+		this->mark_dirty(row);
 }
 
-void VideoOutput::update ()
+void VideoOutput::dump () const
 {
-	const auto nrows = this->buffer.get_nrows();
+	const auto capacity = this->buffer.get_nrows();
 	const auto ncols = this->buffer.get_ncols();
+	const uint32_t first = (this->top + capacity - this->history) % capacity;
+
+	for (uint32_t i = 0; i < (this->history + this->nrows); i++) {
+		const uint32_t row = (first + i) % capacity;
 
-	for (uint32_t row = 0; row < nrows; row++) {
 		for (uint32_t col = 0; col < ncols; col++)
-			mvwprintw(this->win, row+1, col+1, "%c", this->buffer[row, col]);
+			std::cout << this->buffer[row, col];
+		std::cout << std::endl;
 	}
-
-	refresh();
-	wrefresh(this->win);
 }
 
-void VideoOutput::dump () const
+// The history and the visible rows are saved as text, ncols chars per row.
+
+void VideoOutput::save (Snapshot::Writer& out) const
 {
-	const auto nrows = this->buffer.get_nrows();
+	const auto capacity = this->buffer.get_nrows();
 	const auto ncols = this->buffer.get_ncols();
+	const uint32_t first = (this->top + capacity - this->history) % capacity;
+	std::string rows;
+
+	rows.reserve((this->history + this->nrows) * ncols);
+
+	for (uint32_t i = 0; i < (this->history + this->nrows); i++) {
+		const uint32_t row = (first + i) % capacity;
 
-	for (uint32_t row = 0; row < nrows; row++) {
 		for (uint32_t col = 0; col < ncols; col++)
-			std::cout << this->buffer[row, col];
-		std::cout << std::endl;
+			rows += this->buffer[row, col];
+	}
+
+	out.put<uint32_t>(ncols);
+	out.put(this->history);
+	out.put_string(rows);
+	out.put(this->x);
+	out.put(this->y);
+}
+
+// The size of the screen panes depends on the host terminal, so it may not
+// be the one saved. The rows are added again from the first one, as if
+// printed, and longer rows are cut.
+// A file output doesn't write them again.
+
+void VideoOutput::load (Snapshot::Reader& in)
+{
+	const uint32_t saved_ncols = in.get<uint32_t>();
+	const uint32_t saved_history = in.get<uint32_t>();
+	const std::string rows = in.get_string();
+	const uint32_t saved_x = in.get<uint32_t>();
+	const uint32_t saved_y = in.get<uint32_t>();
+
+	mylib_assert_exception_msg(saved_ncols > 0 && (rows.size() % saved_ncols) == 0, "snapshot has a corrupted terminal")
+
+	const auto ncols = this->buffer.get_ncols();
+	const uint32_t nlines = rows.size() / saved_ncols;
+
+	this->top = 0;
+	this->history = 0;
+	this->buffer.set_all(' ');
+
+	for (uint32_t i = 0; i < nlines; i++) {
+		if (i >= this->nrows)
+			this->roll();
+
+		const uint32_t row = std::min(i, this->nrows - 1);
+
+		for (uint32_t col = 0; col < std::min<uint32_t>(ncols, saved_ncols); col++)
+			this->cell(row, col) = rows[i*saved_ncols + col];
 	}
+
+	// the cursor stays in the same line of text
+	const uint32_t cursor_line = saved_history + saved_y;
+	const uint32_t scrolled = (nlines > this->nrows) ? (nlines - this->nrows) : 0;
+
+	this->y = std::min(cursor_line - std::min(cursor_line, scrolled), this->nrows - 1);
+	this->x = std::min<uint32_t>(saved_x, ncols);
+
+	for (uint32_t row = 0; row < this->nrows; row++)
+		this->mark_dirty(row);
 }
 
 // ---------------------------------------
 
-Terminal::Terminal (Computer& computer)
-	: IO_Device(computer)
+FileVideoOutput::FileVideoOutput (const std::string& fname)
+	: VideoOutput(Config::terminal_headless_rows, Config::terminal_headless_cols),
+	  stream(fname)
 {
-	const uint32_t total_w = COLS;
-	const uint32_t total_h = LINES;
+	if (!this->stream.is_open())
+		mylib_throw_exception_msg("cannot create terminal output file ", fname);
+}
 
-	this->videos.reserve( std::to_underlying(Type::Count) );
+void FileVideoOutput::print (const std::string_view str)
+{
+	this->VideoOutput::print(str);
+	this->stream << str;
+}
 
-	// arch video
-	this->videos.emplace_back(1, total_w/3, 1, total_h);
+void FileVideoOutput::flush ()
+{
+	this->stream.flush();
+}
 
-	// kernel video
-	this->videos.emplace_back(total_w/3 + 1, 2*(total_w/3), 1, total_h/2);
+// ---------------------------------------
 
-	// command video
-	this->videos.emplace_back(total_w/3 + 1, 2*(total_w/3), total_h/2 + 1, total_h);
+Terminal::Terminal (Computer& computer, const Settings& settings)
+	: IO_Device(computer, DeviceId::Terminal),
+	  headless(settings.headless)
+{
+	if (this->headless) {
+		// in the order of Type
+		static constexpr auto fnames = std::to_array<const char*>({
+			"kernel.txt",
+			"arch.txt",
+			"command.txt",
+			"app.txt"
+			});
 
-	// app video
-	this->videos.emplace_back(2*(total_w/3) + 1, total_w, 1, total_h);
+		static_assert(fnames.size() == std::to_underlying(Type::Count));
 
-	this->computer.set_io_port(IO_Port::TerminalSet, this);
-	this->computer.set_io_port(IO_Port::TerminalUpload, this);
-	this->computer.set_io_port(IO_Port::TerminalReadTypedChar, this);
+		this->videos.reserve(fnames.size());
+
+		for (const char *fname: fnames)
+			this->videos.push_back( std::make_unique<FileVideoOutput>(settings.output_dir + "/" + fname) );
+
+		this->input_fd = open_input(settings.input_fname);
+	}
+	else {
+	#if defined(CONFIG_HEADLESS_ONLY)
+		mylib_throw_exception_msg("built with CONFIG_HEADLESS_ONLY, there is no screen");
+	#else
+		this->videos = Ncurses::create_videos();
+	#endif
+
+		this->input_fd = 0; // stdin
+	}
+
+	this->last_flush = std::chrono::steady_clock::now();
+
+	this->input_thread = std::jthread(input_thread_main, std::ref(this->computer), std::ref(this->host_input), this->input_fd, this->headless);
+
+	this->schedule(0);
 }
 
 Terminal::~Terminal ()
 {
+	// the thread must be done with input_fd
+	this->input_thread.request_stop();
+	this->input_thread.join();
+
+	close_input(this->input_fd);
 }
 
+// Runs when the input thread posts an event, see Computer::post_terminal_event.
+// Moves the keys typed since the last event to the guest FIFO.
+// Each batch raises a single interrupt, the OS should read
+// TerminalPendingChars and then every pending char.
+// Keys that don't fit the FIFO wait in the host queue, until the guest
+// makes room for them.
+// The screen is also redrawn from here, at most Config::terminal_fps
+// times per second.
+
 void Terminal::run_cycle ()
 {
-	const int typed = getch();
+	const auto now = std::chrono::steady_clock::now();
 
-	if (typed != ERR) {
-		this->has_char = true;
+	if ((now - this->last_flush) >= frame_interval) {
+		this->flush();
+		this->last_flush = now;
+	}
+
+	uint8_t typed;
 
-		if (typed == KEY_BACKSPACE || typed == 127) // || '\b'
-			this->typed_char = 8;
+	while (this->input_fifo_count < this->input_fifo.size() && this->host_input.pop(typed)) {
+		const uint32_t pos = (this->input_fifo_head + this->input_fifo_count) % this->input_fifo.size();
+
+		// The keys come as raw bytes, not through getch(), so a backspace
+		// is DEL or ^H depending on the host terminal. The guest gets ^H.
+		if (typed == 127 || typed == 8)
+			this->input_fifo[pos] = 8;
 		else
-			this->typed_char = typed;
+			this->input_fifo[pos] = typed;
+
+		this->input_fifo_count++;
+		this->pending_interrupt = true;
 	}
 
-	if (this->has_char)
-		this->computer.get_cpu().interrupt(InterruptCode::Keyboard);
+	this->fifo_full = (this->input_fifo_count == this->input_fifo.size());
+
+	if (this->pending_interrupt && this->computer.get_cpu().interrupt(InterruptCode::Keyboard))
+		this->pending_interrupt = false;
+
+	// a rejected interrupt is retried in the next cycle
+	if (this->pending_interrupt)
+		this->schedule(this->computer.get_cycle() + 1);
+}
+
+void Terminal::flush ()
+{
+	for (auto& video: this->videos)
+		video->flush();
+
+#if !defined(CONFIG_HEADLESS_ONLY)
+	if (!this->headless)
+		Ncurses::update_screen();
+#endif
+}
+
+// Keys typed in the host and not yet moved to the guest FIFO are kept,
+// they belong to the current run.
+
+void Terminal::save (Snapshot::Writer& out) const
+{
+	std::array<uint16_t, Config::terminal_input_fifo_size> fifo;
+
+	// the FIFO is saved starting at its head
+	for (uint32_t i = 0; i < this->input_fifo_count; i++)
+		fifo[i] = this->input_fifo[(this->input_fifo_head + i) % this->input_fifo.size()];
+
+	out.begin(DeviceId::Terminal);
+	out.put(this->current_video);
+	out.put(this->upload_paddr);
+	out.put_span(std::span<const uint16_t>(fifo.data(), this->input_fifo_count));
+	out.put(this->pending_interrupt);
+
+	for (const auto& video: this->videos)
+		video->save(out);
+}
+
+void Terminal::load (Snapshot::Reader& in)
+{
+	in.begin(DeviceId::Terminal);
+	in.get(this->current_video);
+	in.get(this->upload_paddr);
+
+	mylib_assert_exception_msg(std::to_underlying(this->current_video) < this->videos.size(), "snapshot has a corrupted terminal")
+
+	const std::vector<uint16_t> fifo = in.get_vector<uint16_t>();
+
+	mylib_assert_exception_msg(fifo.size() <= this->input_fifo.size(), "snapshot has more typed keys than the terminal FIFO holds")
+
+	std::ranges::copy(fifo, this->input_fifo.begin());
+	this->input_fifo_head = 0;
+	this->input_fifo_count = fifo.size();
+	this->fifo_full = (this->input_fifo_count == this->input_fifo.size());
+
+	in.get(this->pending_interrupt);
+
+	for (auto& video: this->videos)
+		video->load(in);
 }
 
 uint16_t Terminal::read (const uint16_t port)
@@ -178,9 +497,25 @@ uint16_t Terminal::read (const uint16_t port)
 			r = std::to_underlying(this->current_video);
 		break;
 		
+		// 0 if there is no char
 		case TerminalReadTypedChar:
-			this->has_char = false;
-			r = this->typed_char;
+			if (this->input_fifo_count > 0) {
+				r = this->input_fifo[this->input_fifo_head];
+				this->input_fifo_head = (this->input_fifo_head + 1) % this->input_fifo.size();
+				this->input_fifo_count--;
+
+				// keys may be waiting in the host queue for this room
+				if (this->fifo_full) {
+					this->fifo_full = false;
+					this->schedule(this->computer.get_cycle() + 1);
+				}
+			}
+			else
+				r = 0;
+		break;
+
+		case TerminalPendingChars:
+			r = this->input_fifo_count;
 		break;
 
 		default:
@@ -203,7 +538,25 @@ void Terminal::write (const uint16_t port, const uint16_t value)
 
 		case TerminalUpload: {
 			const char str[2] = { static_cast<char>(value), 0 };
-			this->videos[ std::to_underlying(this->current_video) ].print(str);
+			this->videos[ std::to_underlying(this->current_video) ]->print(str);
+		}
+		break;
+
+		case TerminalUploadAddr:
+			this->upload_paddr = value;
+		break;
+
+		// prints value chars, one per word, starting at upload_paddr
+		case TerminalUploadLength: {
+			mylib_assert_exception_msg((static_cast<uint32_t>(this->upload_paddr) + value) <= Config::phys_mem_size_words, "Terminal upload out of physical memory: paddr ", this->upload_paddr, " length ", value)
+
+			const uint16_t *words = this->computer.get_memory().get_raw() + this->upload_paddr;
+			std::string str(value, ' ');
+
+			for (uint32_t i = 0; i < value; i++)
+				str[i] = static_cast<char>(words[i]);
+
+			this->videos[ std::to_underlying(this->current_video) ]->print(str);
 		}
 		break;
 
@@ -214,4 +567,11 @@ void Terminal::write (const uint16_t port, const uint16_t value)
 
 // ---------------------------------------
 
+void trace_print (const std::string_view str)
+{
+	Computer::get().get_terminal().print_str(Terminal::Type::Arch, str);
+}
+
+// ---------------------------------------
+
 } // end namespace
\ No newline at end of file
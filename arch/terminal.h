@@ -1,52 +1,103 @@
 #ifndef __ARQSIM_HEADER_ARCH_TERMINAL_H__
 #define __ARQSIM_HEADER_ARCH_TERMINAL_H__
 
-#if defined(CONFIG_TARGET_LINUX)
-	#include <ncurses.h>
-#elif defined(CONFIG_TARGET_WINDOWS)
-	#include <ncurses/ncurses.h>
-#else
-	#error Untested platform
-#endif
-
 #include <string>
 #include <vector>
+#include <fstream>
+#include <array>
+#include <memory>
+#include <thread>
+#include <chrono>
 
 #include <my-lib/std.h>
 #include <my-lib/macros.h>
 #include <my-lib/matrix.h>
 
 #include "device.h"
-#include "computer.h"
+#include "snapshot.h"
 #include "../config.h"
+#include "../lib.h"
 
 namespace Arch {
 
 // ---------------------------------------
 
+// A sub-terminal. The text is kept in a buffer, and each output shows it
+// in its own way: the ncurses screen (see terminal-ncurses.h) or a file.
+
 class VideoOutput
 {
-private:
+protected:
 	using MatrixBuffer = Mylib::Matrix<char, true>;
 
-	WINDOW *win;
-
+	// Circular array with the visible rows plus the scrollback history.
+	// Scrolling just moves top, the row shown first.
 	MatrixBuffer buffer;
+	uint32_t nrows; // visible rows
+	uint32_t top;
+	uint32_t history; // rows kept before top
 
-	// cursor position in the buffer
+	// cursor position in the visible rows
 	uint32_t x;
 	uint32_t y;
 
+	// rows of the buffer changed since the last flush
+	std::vector<bool> dirty_rows;
+	bool dirty;
+
+	VideoOutput (const uint32_t nrows, const uint32_t ncols);
+
 public:
-	VideoOutput (const uint32_t xinit, const uint32_t xend, const uint32_t yinit, const uint32_t yend);
-	~VideoOutput ();
+	virtual ~VideoOutput () = default;
+
+	// only changes the buffer, the output is updated by flush()
+	virtual void print (const std::string_view str);
 
-	void print (const std::string_view str);
+	// shows what changed since the last flush
+	virtual void flush () = 0;
+
+	// prints the history and the visible rows
 	void dump () const;
 
-private:
+	void save (Snapshot::Writer& out) const;
+	void load (Snapshot::Reader& in);
+
+protected:
 	void roll ();
-	void update ();
+
+	// row is relative to the first visible row
+	inline char& cell (const uint32_t row, const uint32_t col)
+	{
+		return this->buffer[(this->top + row) % this->buffer.get_nrows(), col];
+	}
+
+	inline char cell (const uint32_t row, const uint32_t col) const
+	{
+		return this->buffer[(this->top + row) % this->buffer.get_nrows(), col];
+	}
+
+	inline void mark_dirty (const uint32_t row)
+	{
+		this->dirty_rows[row] = true;
+		this->dirty = true;
+	}
+};
+
+// ---------------------------------------
+
+// Headless output, everything printed is appended to a file.
+
+class FileVideoOutput : public VideoOutput
+{
+private:
+	std::ofstream stream;
+
+public:
+	// raises Mylib::Exception if the file can't be created
+	FileVideoOutput (const std::string& fname);
+
+	void print (const std::string_view str) override final;
+	void flush () override final;
 };
 
 // ---------------------------------------
@@ -63,44 +114,106 @@ public:
 		Count       = 4 // amount of sub-terminals
 	};
 
+	// selected at startup, see Computer::init
+	struct Settings {
+		bool headless = Config::headless_only;
+		std::string output_dir = "."; // headless: sub-terminals go to <output_dir>/<type>.txt
+		std::string input_fname;       // headless: keyboard input file or pipe, stdin if empty
+	};
+
+	using HostInputQueue = Lib::SpscQueue<uint8_t, Config::terminal_host_queue_size>;
+
 private:
-	std::vector<VideoOutput> videos;
-	uint16_t typed_char;
-	bool has_char = false;
+	bool headless;
+	std::vector<std::unique_ptr<VideoOutput>> videos;
 	Type current_video = Type::Arch;
+	uint16_t upload_paddr = 0;
+
+	// where input_thread reads the keys from
+	int input_fd;
+
+	// filled by input_thread, emptied by run_cycle
+	HostInputQueue host_input;
+
+	// guest FIFO behind TerminalReadTypedChar
+	std::array<uint16_t, Config::terminal_input_fifo_size> input_fifo;
+	uint32_t input_fifo_head = 0;
+	uint32_t input_fifo_count = 0;
+
+	// a batch of keys arrived, but its interrupt was not accepted yet
+	bool pending_interrupt = false;
+
+	// the last run_cycle filled the FIFO, keys may be left in host_input
+	bool fifo_full = false;
+
+	std::chrono::steady_clock::time_point last_flush;
+
+	// declared last, so it is the first member destroyed
+	std::jthread input_thread;
 
 public:
-	Terminal (Computer& computer);
+	Terminal (Computer& computer, const Settings& settings);
 	~Terminal ();
 
-	void run_cycle () override final;
+	void run_cycle ();
 	uint16_t read (const uint16_t port) override final;
 	void write (const uint16_t port, const uint16_t value) override final;
 
 	void dump (const Type video) const
 	{
-		this->videos[ std::to_underlying(video) ].dump();
+		this->videos[ std::to_underlying(video) ]->dump();
 	}
 
 	void print_str (const Type video, const std::string_view str)
 	{
-		this->videos[ std::to_underlying(video) ].print(str);
+		this->videos[ std::to_underlying(video) ]->print(str);
 	}
+
+	// redraws what changed in all sub-terminals
+	void flush ();
+
+	void save (Snapshot::Writer& out) const;
+	void load (Snapshot::Reader& in);
 };
 
+
 // ---------------------------------------
 
-template <typename... Types>
+// Tracing can be toggled at runtime, but only for the levels
+// enabled at compile time (see Config::trace_level).
+
+inline bool trace_enabled = true;
+
+inline void set_trace_enabled (const bool enabled)
+{
+	trace_enabled = enabled;
+}
+
+template <Config::TraceLevel level>
+inline bool trace_active ()
+{
+	if constexpr (level != Config::TraceLevel::Off && level <= Config::trace_level)
+		return trace_enabled;
+	else
+		return false;
+}
+
+// prints to the Arch sub-terminal
+void trace_print (const std::string_view str);
+
+template <Config::TraceLevel level = Config::TraceLevel::Full, typename... Types>
 void dprint (Types&&... vars)
 {
-	const std::string str = Mylib::build_str_from_stream(vars...);
-	Computer::get().get_terminal().print_str(Terminal::Type::Arch, str);
+	if (trace_active<level>()) {
+		const std::string str = Mylib::build_str_from_stream(vars...);
+		trace_print(str);
+	}
 }
 
-template <typename... Types>
+template <Config::TraceLevel level = Config::TraceLevel::Full, typename... Types>
 void dprintln (Types&&... vars)
 {
-	dprint(vars..., '\n');
+	dprint<level>(vars..., '\n');
 }
 
 // ---------------------------------------
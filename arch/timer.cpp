@@ -1,4 +1,5 @@
 #include <chrono>
+#include <algorithm>
 
 #include "timer.h"
 #include "computer.h"
@@ -18,20 +19,27 @@ static const auto start_time = Clock::now();
 // ---------------------------------------
 
 Timer::Timer (Computer& computer)
-	: IO_Device(computer)
+	: IO_Device(computer, DeviceId::Timer)
 {
-	this->computer.set_io_port(IO_Port::TimerInterruptCycles, this);
-	this->computer.set_io_port(IO_Port::TimerGetTimeSeconds, this);
+	this->schedule(this->count_base + this->timer_interrupt_cycles);
 }
 
+// The count is not stored, it is the amount of cycles since count_base.
+// We are only called when it reaches timer_interrupt_cycles.
+
 void Timer::run_cycle ()
 {
-	if (this->count >= this->timer_interrupt_cycles) {
-		if (this->computer.get_cpu().interrupt(InterruptCode::Timer))
-			this->count = 0;
+	const uint64_t cycle = this->computer.get_cycle();
+
+	if (this->computer.get_cpu().interrupt(InterruptCode::Timer)) {
+		this->count_base = cycle + 1;
+		this->schedule(this->count_base + this->timer_interrupt_cycles);
+	}
+	else {
+		// the count doesn't advance while the interrupt is not accepted
+		this->count_base++;
+		this->schedule(cycle + 1);
 	}
-	else
-		this->count++;
 }
 
 uint16_t Timer::read (const uint16_t port)
@@ -68,6 +76,7 @@ void Timer::write (const uint16_t port, const uint16_t value)
 
 		case TimerInterruptCycles:
 			this->timer_interrupt_cycles = value;
+			this->schedule( std::max(this->count_base + this->timer_interrupt_cycles, this->computer.get_cycle() + 1) );
 		break;
 
 		default:
@@ -75,6 +84,22 @@ void Timer::write (const uint16_t port, const uint16_t value)
 	}
 }
 
+// the next event is restored by the Computer
+
+void Timer::save (Snapshot::Writer& out) const
+{
+	out.begin(DeviceId::Timer);
+	out.put(this->count_base);
+	out.put(this->timer_interrupt_cycles);
+}
+
+void Timer::load (Snapshot::Reader& in)
+{
+	in.begin(DeviceId::Timer);
+	in.get(this->count_base);
+	in.get(this->timer_interrupt_cycles);
+}
+
 // ---------------------------------------
 
 } // end namespace
\ No newline at end of file
@@ -8,6 +8,7 @@
 
 #include "../config.h"
 #include "device.h"
+#include "snapshot.h"
 
 namespace Arch {
 
@@ -16,15 +17,18 @@ namespace Arch {
 class Timer : public IO_Device
 {
 private:
-	uint16_t count = 0;
+	uint64_t count_base = 0; // cycle in which the count was 0
 	uint16_t timer_interrupt_cycles = Config::timer_default_interrupt_cycles;
 
 public:
 	Timer (Computer& computer);
 
-	void run_cycle () override final;
+	void run_cycle ();
 	uint16_t read (const uint16_t port) override final;
 	void write (const uint16_t port, const uint16_t value) override final;
+
+	void save (Snapshot::Writer& out) const;
+	void load (Snapshot::Reader& in);
 };
 
 // ---------------------------------------
@@ -1,5 +1,9 @@
 #include <iostream>
 #include <exception>
+#include <string_view>
+#include <string>
+#include <charconv>
+#include <limits>
 
 #include <cstdint>
 #include <cstdlib>
@@ -12,13 +16,144 @@
 #include "lib.h"
 #include "arch/computer.h"
 #include "arch/terminal.h"
+#include "arch/cpu.h"
 #include "os/os.h"
 
+#if !defined(CONFIG_HEADLESS_ONLY)
+	#include "arch/terminal-ncurses.h"
+#endif
+
+// ---------------------------------------
+
+struct Options {
+	Arch::Cpu::Engine engine = Arch::Cpu::Engine::Interpreter;
+	Arch::Terminal::Settings terminal;
+	Arch::Disk::Settings disk;
+	std::string load_snapshot;
+	std::string save_snapshot;
+	uint64_t snapshot_cycle = Arch::Device::no_event; // when the machine turns off
+	std::string checkpoint_prefix;
+	uint64_t checkpoint_interval = 0; // no checkpoints
+	uint64_t load_checkpoint = Arch::Device::no_event;
+};
+
+static Options options;
+
+// ---------------------------------------
+
+static void usage (const char *bin_name)
+{
+	std::cout << "usage: " << bin_name << " [options]" << std::endl
+		<< "\t--engine=interpreter   reference interpreter (default)" << std::endl
+		<< "\t--engine=block         basic-block translation cache" << std::endl
+		<< "\t--headless             no screen, sub-terminals are written to kernel.txt, arch.txt, command.txt and app.txt" << std::endl
+		<< "\t                       always on when built with CONFIG_HEADLESS_ONLY" << std::endl
+		<< "\t--output-dir=DIR       headless: directory of the sub-terminal files (default .)" << std::endl
+		<< "\t--input=FILE           headless: read the keyboard from a file or pipe (default stdin)" << std::endl
+		<< "\t--disk-image=FILE      open the disk files from an image made by tools/pack-disk-image" << std::endl
+		<< "\t--disk-profile=FILE    disk latency profile, see Arch::Disk::LatencyProfile" << std::endl
+		<< "\t--load-snapshot=FILE   restore the machine after the OS boots" << std::endl
+		<< "\t--save-snapshot=FILE   save the machine when it turns off" << std::endl
+		<< "\t--snapshot-cycle=N     save-snapshot: save at cycle N instead" << std::endl
+		<< "\t--checkpoint-prefix=P  checkpoints are saved to P.0, P.1, ..." << std::endl
+		<< "\t--checkpoint-interval=N  save a checkpoint every N cycles, only the memory pages written since the previous one" << std::endl
+		<< "\t--load-checkpoint=N    roll back to checkpoint N of checkpoint-prefix after the OS boots" << std::endl;
+}
+
+static bool parse_number (const std::string_view str, uint64_t& value)
+{
+	const auto r = std::from_chars(str.data(), str.data() + str.size(), value);
+
+	return r.ec == std::errc() && r.ptr == (str.data() + str.size());
+}
+
+static bool parse_args (int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg = argv[i];
+
+		if (arg == "--engine=interpreter")
+			options.engine = Arch::Cpu::Engine::Interpreter;
+		else if (arg == "--engine=block")
+			options.engine = Arch::Cpu::Engine::BlockCache;
+		else if (arg == "--headless")
+			options.terminal.headless = true;
+		else if (arg.starts_with("--output-dir="))
+			options.terminal.output_dir = arg.substr(std::string_view("--output-dir=").size());
+		else if (arg.starts_with("--input="))
+			options.terminal.input_fname = arg.substr(std::string_view("--input=").size());
+		else if (arg.starts_with("--disk-image="))
+			options.disk.image_fname = arg.substr(std::string_view("--disk-image=").size());
+		else if (arg.starts_with("--disk-profile="))
+			options.disk.profile_fname = arg.substr(std::string_view("--disk-profile=").size());
+		else if (arg.starts_with("--load-snapshot="))
+			options.load_snapshot = arg.substr(std::string_view("--load-snapshot=").size());
+		else if (arg.starts_with("--save-snapshot="))
+			options.save_snapshot = arg.substr(std::string_view("--save-snapshot=").size());
+		else if (arg.starts_with("--snapshot-cycle=")) {
+			if (!parse_number(arg.substr(std::string_view("--snapshot-cycle=").size()), options.snapshot_cycle))
+				return false;
+		}
+		else if (arg.starts_with("--checkpoint-prefix="))
+			options.checkpoint_prefix = arg.substr(std::string_view("--checkpoint-prefix=").size());
+		else if (arg.starts_with("--checkpoint-interval=")) {
+			if (!parse_number(arg.substr(std::string_view("--checkpoint-interval=").size()), options.checkpoint_interval) || options.checkpoint_interval == 0)
+				return false;
+		}
+		else if (arg.starts_with("--load-checkpoint=")) {
+			if (!parse_number(arg.substr(std::string_view("--load-checkpoint=").size()), options.load_checkpoint) || options.load_checkpoint > std::numeric_limits<uint32_t>::max())
+				return false;
+		}
+		else
+			return false;
+	}
+
+	// both need the files of the checkpoints
+	if ((options.checkpoint_interval > 0 || options.load_checkpoint != Arch::Device::no_event) && options.checkpoint_prefix.empty())
+		return false;
+
+	return true;
+}
+
+// ---------------------------------------
+
+static void print_stats ()
+{
+	const Arch::Computer& computer = Arch::Computer::get();
+	const Arch::Cpu& cpu = computer.get_cpu();
+	const Arch::Disk& disk = computer.get_disk();
+	const Arch::Disk::Cost& disk_cost = disk.get_total_cost();
+
+	std::cout << "Cycles: " << computer.get_cycle() << ", idle (halted): " << computer.get_idle_cycles() << std::endl;
+	std::cout << "TLB hits: " << cpu.get_tlb_hits() << ", misses: " << cpu.get_tlb_misses() << std::endl;
+	std::cout << "Disk operations: " << disk.get_operations() << ", cycles: " << disk_cost.total()
+		<< " (controller " << disk_cost.controller << ", seek " << disk_cost.seek
+		<< ", rotation " << disk_cost.rotation << ", transfer " << disk_cost.transfer << ")" << std::endl;
+}
+
+// ---------------------------------------
+
+static void init_screen ()
+{
+#if !defined(CONFIG_HEADLESS_ONLY)
+	if (!options.terminal.headless)
+		Arch::Ncurses::init_screen();
+#endif
+}
+
+static void end_screen ()
+{
+#if !defined(CONFIG_HEADLESS_ONLY)
+	if (!options.terminal.headless)
+		Arch::Ncurses::end_screen();
+#endif
+}
+
 // ---------------------------------------
 
 void Lib::die ()
 {
-	endwin();
+	end_screen();
 	Arch::Computer::get().get_terminal().dump(Arch::Terminal::Type::Kernel);
 	std::exit(EXIT_FAILURE);
 }
@@ -30,34 +165,62 @@ static void interrupt_handler (int dummy)
 
 int main (int argc, char **argv)
 {
+	if (!parse_args(argc, argv)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
 	signal(SIGINT, interrupt_handler);
 
-	// ncurses start
-	initscr();
-	timeout(0); // non-blocking input
-	noecho(); // don't print input
+	init_screen();
 
 	try {
-		Arch::Computer::init();
+		Arch::Computer::init(options.terminal, options.disk);
+		Arch::Computer::get().get_cpu().set_engine(options.engine);
 		OS::boot(&Arch::Computer::get().get_cpu());
+
+		if (!options.load_snapshot.empty())
+			Arch::Computer::get().load_snapshot(options.load_snapshot);
+
+		if (options.load_checkpoint != Arch::Device::no_event)
+			Arch::Computer::get().load_checkpoint(options.checkpoint_prefix, options.load_checkpoint);
+
+		if (options.checkpoint_interval > 0)
+			Arch::Computer::get().save_checkpoints_every(options.checkpoint_prefix, options.checkpoint_interval);
+
+		if (!options.save_snapshot.empty() && options.snapshot_cycle != Arch::Device::no_event)
+			Arch::Computer::get().save_snapshot_at(options.save_snapshot, options.snapshot_cycle);
+
 		Arch::Computer::get().run();
 
-		endwin();
+		if (!options.save_snapshot.empty() && options.snapshot_cycle == Arch::Device::no_event)
+			Arch::Computer::get().save_snapshot(options.save_snapshot);
+
+		// show the last frame
+		Arch::Computer::get().get_terminal().flush();
+
+		end_screen();
 
 		// print kernel msgs
 		Arch::Computer::get().get_terminal().dump(Arch::Terminal::Type::Kernel);
 		std::cout << std::endl;
 
+		print_stats();
+
 		Arch::Computer::destroy();
 	}
 	catch (const std::exception& e) {
-		endwin();
+		end_screen();
 		std::cout << "Exception happenned!" << std::endl << e.what() << std::endl;
-		Arch::Computer::get().get_terminal().dump(Arch::Terminal::Type::Kernel);
+
+		// the exception may come from the Computer constructor
+		if (Arch::Computer::is_initialized())
+			Arch::Computer::get().get_terminal().dump(Arch::Terminal::Type::Kernel);
+
 		return EXIT_FAILURE;
 	}
 	catch (...) {
-		endwin();
+		end_screen();
 		std::cout << "Unknown exception happenned!" << std::endl;
 		return EXIT_FAILURE;
 	}
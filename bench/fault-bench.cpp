@@ -0,0 +1,105 @@
+// Microbenchmark of the page fault path, linked in place of os/os.cpp.
+// The guest loads from a page that is not present, in a loop.
+// The OS skips the faulting instruction, and turns the machine off after
+// nfaults, printing the host time to the Kernel sub-terminal.
+//
+// make CONFIG_TARGET_LINUX=1 CONFIG_TRACE_LEVEL=0 bench
+
+#include <chrono>
+
+#include <cstdint>
+
+#include "../config.h"
+#include "../arch/arch.h"
+#include "../os/os.h"
+#include "../os/os-lib.h"
+
+namespace OS {
+
+// ---------------------------------------
+
+static constexpr uint32_t nfaults = 2'000'000;
+
+// any page but the first one, the only one present
+static constexpr uint16_t fault_vaddr = 256;
+
+using Clock = std::chrono::steady_clock;
+
+static Arch::Cpu *cpu;
+static PageTable page_table;
+static uint32_t faults = 0;
+static Clock::time_point start_time;
+
+static constexpr uint16_t instr_r (const uint16_t opcode, const uint16_t dest, const uint16_t op1, const uint16_t op2)
+{
+	return (opcode << 9) | (dest << 6) | (op1 << 3) | op2;
+}
+
+static constexpr uint16_t instr_i (const uint16_t opcode, const uint16_t reg, const uint16_t imed)
+{
+	return 0x8000 | (opcode << 13) | (reg << 10) | imed;
+}
+
+void boot (Arch::Cpu *cpu_)
+{
+	cpu = cpu_;
+
+	// the trace would be most of the time
+	Arch::set_trace_enabled(false);
+
+	// mov r2, fault_vaddr
+	// loop: load r1, [r2]
+	// jump loop
+	cpu->pmem_write(0, instr_i(3, 2, fault_vaddr));
+	cpu->pmem_write(1, instr_r(15, 1, 2, 0));
+	cpu->pmem_write(2, instr_i(0, 0, 1));
+
+	page_table[0][Arch::Cpu::PteField::PhyFrameID] = 0;
+	page_table[0][Arch::Cpu::PteField::Present] = 1;
+	page_table[0][Arch::Cpu::PteField::Readable] = 1;
+	page_table[0][Arch::Cpu::PteField::Executable] = 1;
+
+	cpu->set_page_table(&page_table);
+	cpu->set_vmem_mode(VmemMode::Paging);
+	cpu->set_pc(0);
+
+	start_time = Clock::now();
+}
+
+// ---------------------------------------
+
+void interrupt (const InterruptCode interrupt)
+{
+	// Not needed here, since the interrupt comes once per batch of keys.
+	// Before the batching, it came every cycle until the char was read,
+	// this keeps the benchmark usable on those commits.
+	if (interrupt == InterruptCode::Keyboard) {
+		cpu->read_io(IO_Port::TerminalReadTypedChar);
+		return;
+	}
+
+	if (interrupt != InterruptCode::CpuException)
+		return;
+
+	// the pc is back at the load
+	cpu->set_pc(cpu->get_pc() + 1);
+
+	if (++faults < nfaults)
+		return;
+
+	const std::chrono::duration<double> elapsed = Clock::now() - start_time;
+
+	terminal_println(cpu, Terminal::Kernel, faults, " faults in ", elapsed.count(), " s");
+	cpu->turn_off();
+}
+
+// ---------------------------------------
+
+void syscall ()
+{
+
+}
+
+// ---------------------------------------
+
+} // end namespace OS
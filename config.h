@@ -3,15 +3,73 @@
 
 #include <cstdint>
 
+// 0 = off, 1 = instructions, 2 = instructions + register dumps
+#ifndef CONFIG_TRACE_LEVEL
+	#define CONFIG_TRACE_LEVEL 2
+#endif
+
 namespace Config {
 
+	enum class TraceLevel : uint8_t {
+		Off            = 0,
+		Instruction    = 1,
+		Full           = 2
+	};
+
+	inline constexpr TraceLevel trace_level = static_cast<TraceLevel>(CONFIG_TRACE_LEVEL);
+
+	// ---------------------------------------
+
 	inline constexpr uint16_t phys_mem_size_bits = 15;
 
 	inline constexpr uint16_t phys_mem_size_words = 1 << phys_mem_size_bits;
 
 	inline constexpr uint16_t timer_default_interrupt_cycles = 1024;
 
+	// Default disk latency profile, used without --disk-profile.
+	// Every operation costs disk_interrupt_cycles, plus disk_dma_cycles_per_word
+	// for each word a DMA read transfers, with no seek or rotational delay.
 	inline constexpr uint32_t disk_interrupt_cycles = 1024 * 10;
+	inline constexpr uint32_t disk_dma_cycles_per_word = 1;
+
+	// longest seek of a profile that doesn't set seek_max_cycles,
+	// host files are 4GB apart in the modelled disk
+	inline constexpr uint32_t disk_seek_max_cycles = 1024 * 20;
+
+	// read requests posted with DiskCmd::QueueReadDma, in flight or waiting for the OS
+	inline constexpr uint32_t disk_queue_size = 16;
+
+	// bytes written by the guest to each file before they are sent to the host file
+	inline constexpr uint32_t disk_write_cache_size = 4096;
+
+	// host threads that read the disk files in the background
+	inline constexpr uint32_t disk_host_io_threads = 1;
+
+	// keys typed in the host not yet seen by the simulation, must be a power of 2
+	inline constexpr uint32_t terminal_host_queue_size = 256;
+
+	// keys the guest can have pending for TerminalReadTypedChar
+	inline constexpr uint32_t terminal_input_fifo_size = 64;
+
+	// maximum screen redraws per second (host time)
+	inline constexpr uint32_t terminal_fps = 30;
+
+	// lines kept above the visible ones in each sub-terminal, printed by Terminal::dump
+	inline constexpr uint32_t terminal_scrollback_lines = 1000;
+
+	// size of each sub-terminal in headless mode, where there is no screen
+	inline constexpr uint32_t terminal_headless_cols = 80;
+	inline constexpr uint32_t terminal_headless_rows = 25;
+
+	// built with make CONFIG_HEADLESS_ONLY=1, without ncurses
+#ifdef CONFIG_HEADLESS_ONLY
+	inline constexpr bool headless_only = true;
+#else
+	inline constexpr bool headless_only = false;
+#endif
+
+	// must be a power of 2
+	inline constexpr uint32_t tlb_entries = 64;
 
 	// ---------------------------------------
 
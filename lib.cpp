@@ -1,6 +1,19 @@
 #include <iostream>
 #include <string_view>
 #include <fstream>
+#include <string>
+#include <limits>
+#include <utility>
+#include <algorithm>
+
+#if defined(CONFIG_TARGET_LINUX)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#elif defined(CONFIG_TARGET_WINDOWS)
+	#include <windows.h>
+#endif
 
 #include <my-lib/std.h>
 #include <my-lib/macros.h>
@@ -43,51 +56,196 @@ uint32_t get_file_size_words (const std::string_view fname)
 
 // ---------------------------------------
 
-static bool load_from_disk_to_buffer (const std::string_view fname, void *ptr, const uint32_t mem_size_bytes)
+MappedFile map_16bit_file (const std::string_view fname)
 {
-	std::ifstream file;
-	
-	file.open(fname.data(), std::ios::binary | std::ios::in);
-	
-	if (!file.is_open())
+	MappedFile file;
+
+	if (!file.open(fname))
+		throw Mylib::Exception(Mylib::build_str_from_stream("cannot load file ", fname));
+
+	mylib_assert_exception_msg((file.get_size() & 0x01) == 0, "file size of ", fname, " is not even")
+
+	return file;
+}
+
+// ---------------------------------------
+
+std::vector<uint16_t> load_from_disk_to_16bit_buffer (const std::string_view fname)
+{
+	const MappedFile file = map_16bit_file(fname);
+	const auto words = file.get_words();
+
+	return std::vector<uint16_t>(words.begin(), words.end());
+}
+
+// ---------------------------------------
+
+uint32_t load_from_disk_to_16bit_span (const std::string_view fname, const std::span<uint16_t> dest)
+{
+	const MappedFile file = map_16bit_file(fname);
+	const auto words = file.get_words();
+
+	mylib_assert_exception_msg(words.size() <= dest.size(), "file ", fname, " has ", words.size(), " words, does not fit in ", dest.size())
+
+	std::ranges::copy(words, dest.begin());
+
+	return words.size();
+}
+
+// ---------------------------------------
+
+MappedFile::MappedFile (MappedFile&& other)
+	: data(std::exchange(other.data, nullptr)),
+	  size(std::exchange(other.size, 0)),
+	  opened(std::exchange(other.opened, false))
+{
+}
+
+MappedFile::~MappedFile ()
+{
+	this->close();
+}
+
+MappedFile& MappedFile::operator= (MappedFile&& other)
+{
+	if (this != &other) {
+		this->close();
+		this->data = std::exchange(other.data, nullptr);
+		this->size = std::exchange(other.size, 0);
+		this->opened = std::exchange(other.opened, false);
+	}
+
+	return *this;
+}
+
+bool MappedFile::open (const std::string_view fname)
+{
+	mylib_assert_exception(!this->opened)
+
+	// the mapping stays valid after the file is closed
+
+#if defined(CONFIG_TARGET_LINUX)
+	const int fd = ::open(std::string(fname).c_str(), O_RDONLY);
+
+	if (fd < 0)
 		return false;
-	
-	file.seekg(0, std::ios::end);
-	const auto bsize = file.tellg();
 
-	if (bsize > mem_size_bytes) {
-		file.close();
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || st.st_size > std::numeric_limits<uint32_t>::max()) {
+		::close(fd);
 		return false;
 	}
 
-	file.seekg(0, std::ios::beg);
+	if (st.st_size > 0) {
+		void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-	file.read(static_cast<char *>(ptr), bsize);
+		if (ptr == MAP_FAILED) {
+			::close(fd);
+			return false;
+		}
+
+		this->data = static_cast<const uint8_t*>(ptr);
+	}
 
-	const auto amount_read = file.gcount();
+	::close(fd);
+	this->size = st.st_size;
+#elif defined(CONFIG_TARGET_WINDOWS)
+	HANDLE file = CreateFileA(std::string(fname).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
 
-	if (amount_read != bsize) {
-		file.close();
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart > std::numeric_limits<uint32_t>::max()) {
+		CloseHandle(file);
 		return false;
 	}
 
-	file.close();
+	// CreateFileMapping refuses empty files
+	if (file_size.QuadPart > 0) {
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+		if (mapping == nullptr) {
+			CloseHandle(file);
+			return false;
+		}
+
+		void *ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+
+		if (ptr == nullptr) {
+			CloseHandle(file);
+			return false;
+		}
+
+		this->data = static_cast<const uint8_t*>(ptr);
+	}
+
+	CloseHandle(file);
+	this->size = file_size.QuadPart;
+#else
+	#error Untested platform
+#endif
+
+	this->opened = true;
 
 	return true;
 }
 
+void MappedFile::close ()
+{
+	if (this->data != nullptr) {
+	#if defined(CONFIG_TARGET_LINUX)
+		munmap(const_cast<uint8_t*>(this->data), this->size);
+	#elif defined(CONFIG_TARGET_WINDOWS)
+		UnmapViewOfFile(this->data);
+	#endif
+	}
+
+	this->data = nullptr;
+	this->size = 0;
+	this->opened = false;
+}
+
 // ---------------------------------------
 
-std::vector<uint16_t> load_from_disk_to_16bit_buffer (const std::string_view fname)
+HostWorker::HostWorker (const uint32_t nthreads)
 {
-	const int32_t file_size_words = Lib::get_file_size_words(fname);
+	mylib_assert_exception(nthreads > 0)
 
-	std::vector<uint16_t> buffer(file_size_words);
+	for (uint32_t i = 0; i < nthreads; i++)
+		this->threads.emplace_back([this] (std::stop_token stop) { this->thread_main(stop); });
+}
 
-	if (!load_from_disk_to_buffer(fname, buffer.data(), file_size_words * sizeof(uint16_t)))
-		throw Mylib::Exception(Mylib::build_str_from_stream("cannot load file ", fname));
+HostWorker::~HostWorker ()
+{
+	// jobs not started yet are dropped, their futures report a broken promise
+	for (auto& thread: this->threads)
+		thread.request_stop();
+
+	for (auto& thread: this->threads)
+		thread.join();
+}
+
+void HostWorker::thread_main (std::stop_token stop)
+{
+	while (true) {
+		std::move_only_function<void ()> job;
 
-	return buffer;
+		{
+			std::unique_lock lock(this->mutex);
+
+			if (!this->cond.wait(lock, stop, [this] { return !this->jobs.empty(); }))
+				return;
+
+			job = std::move(this->jobs.front());
+			this->jobs.pop_front();
+		}
+
+		job();
+	}
 }
 
 // ---------------------------------------
@@ -3,6 +3,17 @@
 
 #include <sstream>
 #include <vector>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <functional>
+#include <type_traits>
+#include <span>
+#include <string_view>
 
 #include <cstdint>
 
@@ -10,17 +21,169 @@ namespace Lib {
 
 // ---------------------------------------
 
+// Read-only memory mapping of a whole file.
+// The size is read once, when the file is opened.
+// An empty file is opened, but has no data.
+
+class MappedFile
+{
+private:
+	const uint8_t *data = nullptr;
+	uint32_t size = 0;
+	bool opened = false;
+
+public:
+	MappedFile () = default;
+	MappedFile (const MappedFile&) = delete;
+	MappedFile (MappedFile&& other);
+	~MappedFile ();
+
+	MappedFile& operator= (MappedFile&& other);
+
+	// returns false if the file cannot be opened, mapped, or is larger than 4GB
+	bool open (const std::string_view fname);
+
+	void close ();
+
+	bool is_open () const
+	{
+		return this->opened;
+	}
+
+	const uint8_t* get_data () const
+	{
+		return this->data;
+	}
+
+	uint32_t get_size () const
+	{
+		return this->size;
+	}
+
+	std::span<const uint8_t> get_span () const
+	{
+		return std::span(this->data, this->size);
+	}
+
+	// The mapping is page aligned, so the words are too.
+	// Only for files of even size, map_16bit_file checks it.
+	std::span<const uint16_t> get_words () const
+	{
+		return std::span(reinterpret_cast<const uint16_t*>(this->data), this->size / sizeof(uint16_t));
+	}
+};
+
+// ---------------------------------------
+
 // raises Mylib::Exception in case of error
 uint32_t get_file_size_words (const std::string_view fname);
 
 // raises Mylib::Exception in case of error
 std::vector<uint16_t> load_from_disk_to_16bit_buffer (const std::string_view fname);
 
+// Maps a file of 16-bit words, read them with get_words().
+// raises Mylib::Exception in case of error
+MappedFile map_16bit_file (const std::string_view fname);
+
+// Copies a file of 16-bit words straight from its mapping to dest,
+// with no intermediate buffer. Returns the amount of words copied.
+// raises Mylib::Exception in case of error, or if the file doesn't fit in dest
+uint32_t load_from_disk_to_16bit_span (const std::string_view fname, const std::span<uint16_t> dest);
+
 // implemented in arq-sim.cpp
 void die ();
 
 // ---------------------------------------
 
+// Lock-free queue for exactly one producer thread and one consumer thread.
+// Holds up to size-1 elements, size must be a power of 2.
+
+template <typename T, uint32_t size>
+class SpscQueue
+{
+private:
+	static_assert((size & (size - 1)) == 0);
+
+	std::array<T, size> buffer;
+
+	// head is only written by the consumer, tail only by the producer
+	alignas(64) std::atomic<uint32_t> head = 0;
+	alignas(64) std::atomic<uint32_t> tail = 0;
+
+public:
+	// returns false if the queue is full
+	bool push (const T& value)
+	{
+		const uint32_t tail = this->tail.load(std::memory_order_relaxed);
+		const uint32_t next = (tail + 1) & (size - 1);
+
+		if (next == this->head.load(std::memory_order_acquire))
+			return false;
+
+		this->buffer[tail] = value;
+		this->tail.store(next, std::memory_order_release);
+
+		return true;
+	}
+
+	// returns false if the queue is empty
+	bool pop (T& value)
+	{
+		const uint32_t head = this->head.load(std::memory_order_relaxed);
+
+		if (head == this->tail.load(std::memory_order_acquire))
+			return false;
+
+		value = this->buffer[head];
+		this->head.store((head + 1) & (size - 1), std::memory_order_release);
+
+		return true;
+	}
+};
+
+// ---------------------------------------
+
+// Pool of host threads that run jobs in the background, so the
+// simulation thread doesn't block on slow host operations.
+// Jobs start in the order they are submitted.
+
+class HostWorker
+{
+private:
+	std::mutex mutex;
+	std::condition_variable_any cond;
+	std::deque<std::move_only_function<void ()>> jobs;
+
+	// declared last, so the threads are joined before the jobs are destroyed
+	std::vector<std::jthread> threads;
+
+public:
+	HostWorker (const uint32_t nthreads);
+	~HostWorker ();
+
+	// the result of job is returned through the future
+	template <typename Tjob>
+	std::future<std::invoke_result_t<Tjob>> submit (Tjob&& job)
+	{
+		std::packaged_task<std::invoke_result_t<Tjob> ()> task(std::forward<Tjob>(job));
+		auto future = task.get_future();
+
+		{
+			std::scoped_lock lock(this->mutex);
+			this->jobs.emplace_back(std::move(task));
+		}
+
+		this->cond.notify_one();
+
+		return future;
+	}
+
+private:
+	void thread_main (std::stop_token stop);
+};
+
+// ---------------------------------------
+
 }
 
 #endif
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <my-lib/macros.h>
 
 #include "../config.h"
+#include "../lib.h"
 #include "../arch/arch.h"
 #include "os.h"
 
@@ -42,6 +43,34 @@ inline void terminal_print_str (Arch::Cpu *cpu, const Terminal video, const std:
 		cpu->write_io(IO_Port::TerminalUpload, static_cast<uint16_t>(c));
 }
 
+// Prints length chars stored one per word in physical memory, with a
+// single I/O transaction.
+
+inline void terminal_print_pmem (Arch::Cpu *cpu, const Terminal video, const uint16_t paddr, const uint16_t length)
+{
+	cpu->write_io(IO_Port::TerminalSet, static_cast<uint16_t>(video));
+	cpu->write_io(IO_Port::TerminalUploadAddr, paddr);
+	cpu->write_io(IO_Port::TerminalUploadLength, length);
+}
+
+// Loads a guest binary straight from its file mapping to physical memory,
+// with no intermediate buffer.
+// Returns the size of the binary in words.
+// Raises Mylib::Exception if paddr is outside physical memory,
+// or if the binary doesn't fit between paddr and the end of it.
+
+inline uint32_t load_binary_to_pmem (Arch::Cpu *cpu, const std::string_view fname, const uint16_t paddr)
+{
+	mylib_assert_exception_msg(paddr < Config::phys_mem_size_words, "cannot load ", fname, " at ", paddr, ", physical memory has ", Config::phys_mem_size_words, " words")
+
+	uint16_t *pmem = Arch::Computer::get().get_memory().get_raw();
+	const uint32_t words = Lib::load_from_disk_to_16bit_span(fname, std::span(pmem + paddr, Config::phys_mem_size_words - paddr));
+
+	cpu->invalidate_code(paddr, words);
+
+	return words;
+}
+
 template <typename... Types>
 void terminal_print (Arch::Cpu *cpu, const Terminal video, Types&&... vars)
 {
@@ -0,0 +1,160 @@
+// Packs every file of a host directory in a disk image,
+// to be mounted with arq-sim-so --disk-image=FILE.
+// The guest opens each file by its path relative to the directory,
+// using / as separator.
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "../arch/disk-image.h"
+
+// ---------------------------------------
+
+namespace fs = std::filesystem;
+
+using namespace Arch;
+
+struct File {
+	std::string name;
+	fs::path path;
+	uint32_t size;
+};
+
+// ---------------------------------------
+
+static uint32_t align (const uint64_t value, const uint32_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint32_t check_u32 (const uint64_t value)
+{
+	if (value > std::numeric_limits<uint32_t>::max()) {
+		std::cerr << "disk image would be larger than 4GB" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
+int main (int argc, char **argv)
+{
+	if (argc != 3) {
+		std::cout << "usage: " << argv[0] << " <directory> <image>" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const fs::path dir = argv[1];
+	std::vector<File> files;
+
+	for (const auto& it: fs::recursive_directory_iterator(dir)) {
+		if (!it.is_regular_file())
+			continue;
+
+		files.push_back(File {
+			.name = fs::relative(it.path(), dir).generic_string(),
+			.path = it.path(),
+			.size = check_u32(it.file_size())
+			});
+	}
+
+	// the same directory always gives the same image
+	std::ranges::sort(files, {}, &File::name);
+
+	// about 2 buckets per file, so chains are short
+	uint32_t nbuckets = 1;
+
+	while (nbuckets < (files.size() * 2))
+		nbuckets *= 2;
+
+	DiskImage::Header header;
+	std::memcpy(header.magic, DiskImage::magic, sizeof(header.magic));
+	header.version = DiskImage::version;
+	header.nbuckets = nbuckets;
+	header.nentries = files.size();
+	header.buckets_offset = sizeof(DiskImage::Header);
+	header.entries_offset = align(header.buckets_offset + static_cast<uint64_t>(nbuckets) * sizeof(uint32_t), alignof(DiskImage::Entry));
+	header.names_offset = check_u32(header.entries_offset + static_cast<uint64_t>(files.size()) * sizeof(DiskImage::Entry));
+
+	std::vector<uint32_t> buckets(nbuckets, DiskImage::no_entry);
+	std::vector<DiskImage::Entry> entries(files.size());
+	std::string names;
+
+	for (const File& file: files)
+		names += file.name;
+
+	uint64_t data_offset = header.names_offset + names.size();
+
+	for (uint32_t i = 0; i < files.size(); i++) {
+		DiskImage::Entry& entry = entries[i];
+		const uint32_t bucket = DiskImage::hash(files[i].name) & (nbuckets - 1);
+
+		entry.hash = DiskImage::hash(files[i].name);
+		entry.next = buckets[bucket];
+		entry.name_offset = (i == 0) ? 0 : (entries[i-1].name_offset + entries[i-1].name_length);
+		entry.name_length = files[i].name.size();
+		entry.data_offset = check_u32(align(data_offset, DiskImage::data_alignment));
+		entry.data_size = files[i].size;
+
+		buckets[bucket] = i;
+		data_offset = check_u32(static_cast<uint64_t>(entry.data_offset) + entry.data_size);
+	}
+
+	std::ofstream image(argv[2], std::ios::binary | std::ios::out | std::ios::trunc);
+
+	if (!image.is_open()) {
+		std::cerr << "cannot create " << argv[2] << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const auto pad_to = [&image] (const uint64_t offset) {
+		while (static_cast<uint64_t>(image.tellp()) < offset)
+			image.put(0);
+	};
+
+	image.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	image.write(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(uint32_t));
+	pad_to(header.entries_offset);
+	image.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(DiskImage::Entry));
+	image.write(names.data(), names.size());
+
+	for (uint32_t i = 0; i < files.size(); i++) {
+		std::ifstream file(files[i].path, std::ios::binary | std::ios::in);
+
+		if (!file.is_open()) {
+			std::cerr << "cannot open " << files[i].path << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		pad_to(entries[i].data_offset);
+
+		// Exactly the size in the entry, the file may have changed since.
+		// The offsets of the files after it depend on that size.
+		std::vector<char> data(files[i].size);
+
+		if (!file.read(data.data(), data.size())) {
+			std::cerr << files[i].path << " was truncated while packing it" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		image.write(data.data(), data.size());
+	}
+
+	if (!image.good()) {
+		std::cerr << "cannot write " << argv[2] << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "packed " << files.size() << " files in " << argv[2] << std::endl;
+
+	return EXIT_SUCCESS;
+}